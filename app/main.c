@@ -1,7 +1,668 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "../src/lab.h"
 
-int main(void)
+/**
+ * Workload driver. A workload is a flat list of malloc, free and realloc
+ * operations on numbered slots, either generated from a size distribution or
+ * rebuilt from a trace written by buddy_trace_start. Each allocator replays
+ * the same list in a child process of its own so RSS is not shared.
+ */
+
+#define MIB (1024.0 * 1024.0)
+
+struct op
+{
+    uint64_t size;              /*Requested size, 0 for a free*/
+    uint32_t slot;              /*Slot the pointer lives in*/
+    uint32_t kind;              /*BUDDY_OP_MALLOC, BUDDY_OP_FREE or BUDDY_OP_REALLOC*/
+};
+
+struct workload
+{
+    struct op *ops;
+    size_t count;
+    size_t cap;
+    size_t slots;               /*Slots used, one per concurrently live pointer*/
+    size_t peak_live;           /*Most requested bytes live at once*/
+    size_t peak_at;             /*Operations done when peak_live was first reached*/
+    size_t skipped;             /*Trace records that could not be replayed*/
+};
+
+struct options
+{
+    const char *workload;
+    const char *alloc;
+    const char *replay;
+    const char *record;
+    size_t ops;
+    size_t slots;
+    size_t max_size;
+    size_t pool_k;
+    uint64_t seed;
+};
+
+/**
+ * @brief xorshift64*, so workloads are the same on every libc
+ */
+static uint64_t rng_next(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * UINT64_C(2685821657736338717);
+}
+
+/**
+ * @brief Uniform double in (0, 1)
+ */
+static double rng_unit(uint64_t *state)
+{
+    return ((double)(rng_next(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/**
+ * @brief Draw a request size from the named distribution, 0 if it is unknown
+ */
+static size_t draw_size(const char *dist, size_t max, uint64_t *rng)
+{
+    size_t size = 0;
+    if (!strcmp(dist, "uniform")) {
+        size = 1 + (size_t)(rng_next(rng) % max);
+    } else if (!strcmp(dist, "lognormal") || !strcmp(dist, "prodcons")) {
+        //Median 64 bytes with a long tail, the usual shape of heap requests
+        double normal = sqrt(-2.0 * log(rng_unit(rng))) * cos(2.0 * M_PI * rng_unit(rng));
+        double bytes = exp(log(64.0) + 1.5 * normal);
+        size = bytes < 1.0 ? 1 : bytes > (double)max ? max : (size_t)bytes;
+    } else if (!strcmp(dist, "pow2")) {
+        size_t top = btok(max);
+        size = (size_t)1 << (3 + rng_next(rng) % (top > 3 ? top - 2 : 1));
+        size = size > max ? max : size;
+    }
+    return size;
+}
+
+/**
+ * @brief Append an operation, growing the list as needed
+ */
+static void push_op(struct workload *w, uint32_t kind, uint32_t slot, uint64_t size)
+{
+    if (w->count == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 4096;
+        w->ops = realloc(w->ops, w->cap * sizeof(struct op));
+        if (!w->ops) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    w->ops[w->count++] = (struct op){size, slot, kind};
+}
+
+/**
+ * Generate a synthetic workload. The churn workloads pick a random slot for
+ * every operation and free it if it is live or fill it otherwise, so about
+ * half the slots are live. Producer/consumer fills slots in ring order and
+ * frees the oldest allocation once the ring is full, so every object lives
+ * for exactly slots allocations.
+ */
+static int generate(struct workload *w, const struct options *opt)
+{
+    uint64_t rng = opt->seed ? opt->seed : 1;
+    size_t *live = calloc(opt->slots, sizeof(size_t));
+    if (!live || !draw_size(opt->workload, opt->max_size, &rng)) {
+        free(live);
+        return -1;
+    }
+    bool ring = !strcmp(opt->workload, "prodcons");
+    size_t bytes = 0;
+    for (size_t i = 0; w->count < opt->ops; i++) {
+        size_t slot = ring ? i % opt->slots : (size_t)(rng_next(&rng) % opt->slots);
+        if (live[slot]) {
+            push_op(w, BUDDY_OP_FREE, (uint32_t)slot, 0);
+            bytes -= live[slot];
+            live[slot] = 0;
+            if (!ring) {
+                continue;
+            }
+        }
+        live[slot] = draw_size(opt->workload, opt->max_size, &rng);
+        push_op(w, BUDDY_OP_MALLOC, (uint32_t)slot, live[slot]);
+        bytes += live[slot];
+        if (bytes > w->peak_live) {
+            w->peak_live = bytes;
+            w->peak_at = w->count;
+        }
+    }
+    w->slots = opt->slots;
+    free(live);
+    return 0;
+}
+
+/**
+ * Open addressing map from traced offsets to slots with linear probing and
+ * backward shift deletion, so long traces do not fill up with tombstones.
+ */
+struct offset_map
+{
+    uint64_t *keys;             /*Offset plus one, 0 marks an empty entry*/
+    uint32_t *slots;
+    size_t mask;
+};
+
+static size_t map_home(const struct offset_map *m, uint64_t key)
+{
+    return (size_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> 17) & m->mask;
+}
+
+static size_t map_find(const struct offset_map *m, uint64_t offset)
+{
+    size_t i = map_home(m, offset + 1);
+    while (m->keys[i] && m->keys[i] != offset + 1) {
+        i = (i + 1) & m->mask;
+    }
+    return i;
+}
+
+static void map_remove(struct offset_map *m, size_t i)
+{
+    m->keys[i] = 0;
+    for (size_t j = (i + 1) & m->mask; m->keys[j]; j = (j + 1) & m->mask) {
+        size_t home = map_home(m, m->keys[j]);
+        //Move j back into the hole unless its home lies cyclically in (i, j]
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->keys[i] = m->keys[j];
+            m->slots[i] = m->slots[j];
+            m->keys[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/**
+ * Slots of the trace replay. Freed slots are reused last in first out so the
+ * slot array stays as small as the peak number of live pointers.
+ */
+struct slot_pool
+{
+    uint32_t *free;
+    size_t nfree;
+    size_t next;
+    size_t *size;
+};
+
+static uint32_t slot_get(struct slot_pool *s)
+{
+    return s->nfree ? s->free[--s->nfree] : (uint32_t)s->next++;
+}
+
+static void slot_put(struct slot_pool *s, uint32_t slot)
+{
+    s->free[s->nfree++] = slot;
+}
+
+/**
+ * Rebuild a workload from a trace file. Records are replayed in the order
+ * they were written, as fast as possible and from a single thread, whatever
+ * threads and timing the traced process had. Frees and reallocs of pointers
+ * allocated before the oldest record still in the ring, and mallocs that
+ * failed when traced, are skipped.
+ */
+static int load_trace(struct workload *w, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    struct buddy_trace_header *tr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*tr)) {
+        tr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == tr) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return -1;
+    }
+    if (memcmp(tr->magic, BUDDY_TRACE_MAGIC, sizeof(tr->magic)) || tr->version != BUDDY_TRACE_VERSION ||
+        tr->record_size != sizeof(struct buddy_trace_record) ||
+        (size_t)st.st_size < sizeof(*tr) + tr->capacity * sizeof(struct buddy_trace_record)) {
+        fprintf(stderr, "%s: unsupported or truncated trace\n", path);
+        munmap(tr, (size_t)st.st_size);
+        return -1;
+    }
+    const struct buddy_trace_record *rec = (const struct buddy_trace_record *)(tr + 1);
+    uint64_t first = tr->head > tr->capacity ? tr->head - tr->capacity : 0;
+    size_t n = (size_t)(tr->head - first);
+    if (tr->wraps) {
+        fprintf(stderr, "%s: ring wrapped %" PRIu64 " times, replaying the newest %zu of %" PRIu64 " records\n",
+                path, tr->wraps, n, tr->head);
+    }
+
+    struct offset_map map = {0};
+    for (map.mask = 1; map.mask < 2 * n; map.mask <<= 1) {
+    }
+    struct slot_pool slots = {0};
+    map.keys = calloc(map.mask, sizeof(uint64_t));
+    map.slots = calloc(map.mask, sizeof(uint32_t));
+    slots.free = calloc(n + 1, sizeof(uint32_t));
+    slots.size = calloc(n + 1, sizeof(size_t));
+    map.mask--;
+    if (!map.keys || !map.slots || !slots.free || !slots.size) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t bytes = 0;
+    for (uint64_t seq = first; seq < tr->head; seq++) {
+        const struct buddy_trace_record *r = &rec[seq % tr->capacity];
+        //A realloc is looked up by the pointer it was passed
+        uint64_t from = r->op == BUDDY_OP_REALLOC ? r->old_offset : r->offset;
+        size_t at = map_find(&map, from);
+        bool known = from != BUDDY_TRACE_NULL && map.keys[at];
+        uint32_t slot = known ? map.slots[at] : 0;
+
+        if (r->op == BUDDY_OP_MALLOC || r->op == BUDDY_OP_FREE) {
+            if (known) {
+                //A malloc of a live offset means the free was lost, free it first
+                push_op(w, BUDDY_OP_FREE, slot, 0);
+                map_remove(&map, at);
+                bytes -= slots.size[slot];
+                slot_put(&slots, slot);
+            } else if (r->op == BUDDY_OP_FREE && r->offset != BUDDY_TRACE_NULL) {
+                w->skipped++;
+            }
+            if (r->op == BUDDY_OP_FREE) {
+                continue;
+            }
+            if (r->offset == BUDDY_TRACE_NULL) {
+                w->skipped++;
+                continue;
+            }
+            slot = slot_get(&slots);
+            push_op(w, BUDDY_OP_MALLOC, slot, r->size);
+        } else if (r->op == BUDDY_OP_REALLOC) {
+            if (!known && from != BUDDY_TRACE_NULL) {
+                //The old pointer predates the ring, start the object here
+                w->skipped++;
+                if (r->offset == BUDDY_TRACE_NULL) {
+                    continue;
+                }
+                slot = slot_get(&slots);
+                push_op(w, BUDDY_OP_MALLOC, slot, r->size);
+            } else {
+                if (!known) {
+                    slot = slot_get(&slots);
+                    slots.size[slot] = 0;
+                }
+                push_op(w, BUDDY_OP_REALLOC, slot, r->size);
+                if (r->offset == BUDDY_TRACE_NULL && r->size) {
+                    continue; //Failed, the old block is still live
+                }
+                if (known) {
+                    map_remove(&map, at);
+                }
+                bytes -= slots.size[slot];
+                if (r->offset == BUDDY_TRACE_NULL) {
+                    slot_put(&slots, slot);
+                    continue;
+                }
+            }
+        } else {
+            w->skipped++;
+            continue;
+        }
+        at = map_find(&map, r->offset);
+        map.keys[at] = r->offset + 1;
+        map.slots[at] = slot;
+        slots.size[slot] = r->size;
+        bytes += r->size;
+        if (bytes > w->peak_live) {
+            w->peak_live = bytes;
+            w->peak_at = w->count;
+        }
+    }
+    w->slots = slots.next ? slots.next : 1;
+    free(map.keys);
+    free(map.slots);
+    free(slots.free);
+    free(slots.size);
+    munmap(tr, (size_t)st.st_size);
+    return 0;
+}
+
+/**
+ * An allocator under test. The buddy entry points are wrapped so both
+ * allocators pay for the same indirect call.
+ */
+struct allocator
+{
+    const char *name;
+    void *(*alloc)(void *ctx, size_t size);
+    void (*release)(void *ctx, void *ptr);
+    void *(*resize)(void *ctx, void *ptr, size_t size);
+};
+
+static void *buddy_alloc_op(void *ctx, size_t size)
+{
+    return buddy_malloc(ctx, size);
+}
+
+static void buddy_release_op(void *ctx, void *ptr)
+{
+    buddy_free(ctx, ptr);
+}
+
+static void *buddy_resize_op(void *ctx, void *ptr, size_t size)
+{
+    return buddy_realloc(ctx, ptr, size);
+}
+
+static void *libc_alloc_op(void *ctx, size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void libc_release_op(void *ctx, void *ptr)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+static void *libc_resize_op(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    if (!size) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, size);
+}
+
+static const struct allocator allocators[] = {
+    {"buddy", buddy_alloc_op, buddy_release_op, buddy_resize_op},
+    {"libc", libc_alloc_op, libc_release_op, libc_resize_op},
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Resident set size of this process in bytes
+ */
+static size_t rss_bytes(void)
+{
+    long pages = 0;
+    long resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * RSS and pool counters sampled at the same moment, right when the workload
+ * has the most bytes live.
+ */
+struct peak_sample
+{
+    struct buddy_pool *pool;    /*Pool to read the counters of, NULL for libc*/
+    struct buddy_stats st;
+    size_t rss;
+};
+
+/**
+ * Run every operation of the workload. When lat is not NULL each operation
+ * is timed on its own into lat, otherwise only the whole run is timed. When
+ * peak is not NULL it is filled in once the first w->peak_at operations
+ * are done.
+ * Returns the wall time in nanoseconds and counts failed allocations.
+ */
+static uint64_t replay(const struct allocator *a, void *ctx, const struct workload *w, void **slots,
+                       uint32_t *lat, size_t *failures, struct peak_sample *peak)
+{
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < w->count; i++) {
+        const struct op *op = &w->ops[i];
+        uint64_t t0 = lat ? now_ns() : 0;
+        if (op->kind == BUDDY_OP_MALLOC) {
+            slots[op->slot] = a->alloc(ctx, op->size);
+            *failures += !slots[op->slot];
+        } else if (op->kind == BUDDY_OP_FREE) {
+            a->release(ctx, slots[op->slot]);
+            slots[op->slot] = NULL;
+        } else {
+            void *ptr = a->resize(ctx, slots[op->slot], op->size);
+            if (ptr || !op->size) {
+                slots[op->slot] = ptr;
+            }
+            *failures += !ptr && op->size;
+        }
+        if (lat) {
+            lat[i] = (uint32_t)(now_ns() - t0);
+        }
+        if (peak && i + 1 == w->peak_at) {
+            //Sampled outside the wall time
+            uint64_t s0 = now_ns();
+            peak->rss = rss_bytes();
+            if (peak->pool) {
+                buddy_stats(peak->pool, &peak->st);
+            }
+            start += now_ns() - s0;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    for (size_t i = 0; i < w->slots; i++) {
+        a->release(ctx, slots[i]);
+        slots[i] = NULL;
+    }
+    return elapsed;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print p50/p99/p99.9 of the samples of one kind of operation
+ */
+static void print_percentiles(const char *name, const char *kind_name, const struct workload *w,
+                              const uint32_t *lat, uint32_t kind, uint32_t *scratch)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < w->count; i++) {
+        if (w->ops[i].kind == kind) {
+            scratch[n++] = lat[i];
+        }
+    }
+    if (!n) {
+        return;
+    }
+    qsort(scratch, n, sizeof(uint32_t), cmp_u32);
+    printf("%-6s %-8s p50 %6u ns  p99 %6u ns  p99.9 %7u ns  max %8u ns\n", name, kind_name,
+           scratch[n / 2], scratch[n * 99 / 100], scratch[n * 999 / 1000], scratch[n - 1]);
+}
+
+/**
+ * Measure one allocator, meant to run in a child process. The first pass is
+ * untimed per operation and gives ops/s, peak RSS and, for the buddy pool,
+ * fragmentation. The second pass times every operation for percentiles.
+ */
+static void measure(const struct allocator *a, const struct workload *w, const struct options *opt)
+{
+    void **slots = calloc(w->slots, sizeof(void *));
+    uint32_t *lat = calloc(w->count, sizeof(uint32_t));
+    uint32_t *scratch = calloc(w->count, sizeof(uint32_t));
+    if (!slots || !lat || !scratch) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    //Touch the timing arrays now so they do not show up as allocator RSS
+    memset(lat, 0xff, w->count * sizeof(uint32_t));
+    memset(scratch, 0xff, w->count * sizeof(uint32_t));
+
+    bool buddy = a->alloc == buddy_alloc_op;
+    struct buddy_pool pool;
+    struct buddy_stats st;
+    struct peak_sample peak = {0};
+    peak.pool = buddy ? &pool : NULL;
+    size_t failures = 0;
+    size_t base_rss = rss_bytes();
+    if (buddy) {
+        buddy_init(&pool, (size_t)1 << opt->pool_k);
+    }
+    uint64_t elapsed = replay(a, buddy ? (void *)&pool : NULL, w, slots, NULL, &failures, &peak);
+    size_t grown = peak.rss > base_rss ? peak.rss - base_rss : 0;
+    if (buddy) {
+        buddy_stats(&pool, &st);
+        buddy_destroy(&pool);
+        buddy_init(&pool, (size_t)1 << opt->pool_k);
+    }
+
+    printf("%-6s %.2f Mops/s  %.1f ns/op  rss at peak live +%.1f MiB (%.2fx live)  failures %zu\n", a->name,
+           (double)w->count * 1e3 / (double)elapsed, (double)elapsed / (double)w->count, grown / MIB,
+           w->peak_live ? (double)grown / (double)w->peak_live : 0.0, failures);
+    if (buddy) {
+        printf("%-6s reserved at peak live %.1f MiB  internal fragmentation %.1f%%  split %zu  merge %zu\n",
+               a->name, peak.st.reserved / MIB,
+               peak.st.reserved ? 100.0 * (1.0 - (double)w->peak_live / (double)peak.st.reserved) : 0.0,
+               st.cost.splits, st.cost.merges);
+    }
+
+    failures = 0;
+    replay(a, buddy ? (void *)&pool : NULL, w, slots, lat, &failures, NULL);
+    print_percentiles(a->name, "malloc", w, lat, BUDDY_OP_MALLOC, scratch);
+    print_percentiles(a->name, "free", w, lat, BUDDY_OP_FREE, scratch);
+    print_percentiles(a->name, "realloc", w, lat, BUDDY_OP_REALLOC, scratch);
+    if (buddy) {
+        buddy_destroy(&pool);
+    }
+
+    //Recorded on a pass of its own so the ring is in neither the RSS nor
+    //the latencies measured above
+    if (buddy && opt->record) {
+        buddy_init(&pool, (size_t)1 << opt->pool_k);
+        if (buddy_trace_start(&pool, opt->record, w->count + w->slots) == -1) {
+            perror(opt->record);
+        } else {
+            failures = 0;
+            replay(a, &pool, w, slots, NULL, &failures, NULL);
+        }
+        buddy_destroy(&pool);
+    }
+    free(slots);
+    free(lat);
+    free(scratch);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-w uniform|lognormal|pow2|prodcons] [-r trace] [-a buddy|libc|both]\n"
+            "          [-n ops] [-s slots] [-m max_size] [-k pool_order] [-S seed] [-t trace_out]\n"
+            "  -w  synthetic workload (default lognormal)\n"
+            "  -r  replay a trace written by buddy_trace_start instead\n"
+            "  -a  allocators to run (default both)\n"
+            "  -n  operations to generate (default 2000000)\n"
+            "  -s  slots, the most pointers live at once (default 4096)\n"
+            "  -m  largest request of the synthetic workloads (default 4096)\n"
+            "  -k  order of the buddy pool (default %d)\n"
+            "  -S  random seed (default 1)\n"
+            "  -t  record the buddy run as a trace file\n",
+            prog, DEFAULT_K);
+}
+
+int myMain(int argc, char **argv)
+{
+    struct options opt = {"lognormal", "both", NULL, NULL, 2000000, 4096, 4096, DEFAULT_K, 1};
+    int c;
+    while ((c = getopt(argc, argv, "w:r:a:n:s:m:k:S:t:h")) != -1) {
+        switch (c) {
+        case 'w': opt.workload = optarg; break;
+        case 'r': opt.replay = optarg; break;
+        case 'a': opt.alloc = optarg; break;
+        case 'n': opt.ops = strtoull(optarg, NULL, 0); break;
+        case 's': opt.slots = strtoull(optarg, NULL, 0); break;
+        case 'm': opt.max_size = strtoull(optarg, NULL, 0); break;
+        case 'k': opt.pool_k = strtoull(optarg, NULL, 0); break;
+        case 'S': opt.seed = strtoull(optarg, NULL, 0); break;
+        case 't': opt.record = optarg; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (!opt.ops || !opt.slots || opt.slots > UINT32_MAX || !opt.max_size || opt.pool_k < MIN_K ||
+        opt.pool_k >= MAX_K || (strcmp(opt.alloc, "buddy") && strcmp(opt.alloc, "libc") && strcmp(opt.alloc, "both"))) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct workload w = {0};
+    if (opt.replay ? load_trace(&w, opt.replay) : generate(&w, &opt)) {
+        if (!opt.replay) {
+            fprintf(stderr, "unknown workload %s\n", opt.workload);
+        }
+        free(w.ops);
+        return EXIT_FAILURE;
+    }
+    printf("workload %s  ops %zu  slots %zu  peak live %.1f MiB", opt.replay ? opt.replay : opt.workload,
+           w.count, w.slots, w.peak_live / MIB);
+    if (opt.replay) {
+        printf("  skipped %zu", w.skipped);
+    }
+    printf("\n");
+
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        if (strcmp(opt.alloc, "both") && strcmp(opt.alloc, allocators[i].name)) {
+            continue;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            measure(&allocators[i], &w, &opt);
+            fflush(stdout);
+            _exit(EXIT_SUCCESS);
+        }
+        int wstatus = 0;
+        if (pid < 0 || waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+            fprintf(stderr, "%s run failed\n", allocators[i].name);
+            status = EXIT_FAILURE;
+        }
+    }
+    free(w.ops);
+    return status;
+}
+
+int main(int argc, char **argv)
 {
-  printf("hello world\n");
-  return 0;
+    return myMain(argc, argv);
 }
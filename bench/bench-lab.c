@@ -0,0 +1,1949 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../src/lab.h"
+
+/**
+ * @brief Monotonic wall clock in nanoseconds
+ */
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * Hardware and software counters read through perf_event_open around the
+ * timed region of every microbenchmark when --counters is given. Counters
+ * the kernel, the CPU or a container does not provide are left out, so the
+ * suite runs everywhere and reports what it can.
+ */
+#define L1D_READ_MISS (PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | \
+                       PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+#define DTLB_READ_MISS (PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | \
+                        PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static struct counter
+{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+} counters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1},
+    {"l1d_misses", PERF_TYPE_HW_CACHE, L1D_READ_MISS, -1},
+    {"dtlb_misses", PERF_TYPE_HW_CACHE, DTLB_READ_MISS, -1},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1},
+    {"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1},
+};
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+/**
+ * @brief Open every counter this process may use, returning how many opened
+ */
+static size_t counters_open(void)
+{
+    size_t opened = 0;
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters[i].fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters[i].fd < 0) {
+            fprintf(stderr, "counter %s unavailable: %s\n", counters[i].name, strerror(errno));
+        } else {
+            opened++;
+        }
+    }
+    return opened;
+}
+
+static void counters_close(void)
+{
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        if (counters[i].fd >= 0) {
+            close(counters[i].fd);
+            counters[i].fd = -1;
+        }
+    }
+}
+
+static void counters_ioctl(unsigned long request)
+{
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        if (counters[i].fd >= 0) {
+            ioctl(counters[i].fd, request, 0);
+        }
+    }
+}
+
+/**
+ * Read the counts since the last reset, scaled up when the kernel had to
+ * multiplex the counter. Counters that are not open or never ran read -1.
+ */
+static void counters_read(double *out)
+{
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        uint64_t v[3];
+        out[i] = -1;
+        if (counters[i].fd >= 0 && read(counters[i].fd, v, sizeof(v)) == sizeof(v) && v[2]) {
+            out[i] = (double)v[0] * ((double)v[1] / (double)v[2]);
+        }
+    }
+}
+
+/**
+ * @brief Start the timed region of a microbenchmark
+ */
+static double micro_begin(void)
+{
+    counters_ioctl(PERF_EVENT_IOC_ENABLE);
+    return now_ns();
+}
+
+/**
+ * @brief End the timed region started at start, returning its nanoseconds
+ */
+static double micro_end(double start)
+{
+    double elapsed = now_ns() - start;
+    counters_ioctl(PERF_EVENT_IOC_DISABLE);
+    return elapsed;
+}
+
+/**
+ * @brief Minor page faults taken by this process so far
+ */
+static long minor_faults(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+/**
+ * Create and destroy short lived pools that each touch a small working set.
+ * Run once with the mapping cache disabled and once for each scrub mode.
+ */
+static void bench_pool_churn(void)
+{
+    const size_t cycles = 2000;
+    const size_t touch = 64;
+    struct
+    {
+        const char *name;
+        size_t entries;
+        int scrub;
+    } modes[] = {
+        {"nocache", 0, BUDDY_CACHE_KEEP},
+        {"keep", BUDDY_CACHE_DEFAULT, BUDDY_CACHE_KEEP},
+        {"dontneed", BUDDY_CACHE_DEFAULT, BUDDY_CACHE_DONTNEED},
+    };
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        buddy_cache_config(modes[m].entries, modes[m].scrub);
+        long faults = minor_faults();
+        double start = now_ns();
+        for (size_t i = 0; i < cycles; i++) {
+            struct buddy_pool pool;
+            buddy_init(&pool, UINT64_C(1) << 24);
+            for (size_t j = 0; j < touch; j++) {
+                char *p = buddy_malloc(&pool, 4000);
+                memset(p, (int)j, 4000);
+            }
+            buddy_destroy(&pool);
+        }
+        double elapsed = now_ns() - start;
+        faults = minor_faults() - faults;
+        printf("pool_churn/%-9s %10.0f cycles/s %8.1f faults/cycle\n", modes[m].name,
+               cycles / (elapsed / 1e9), (double)faults / cycles);
+        buddy_cache_flush();
+    }
+    buddy_cache_config(0, BUDDY_CACHE_KEEP);
+}
+
+/**
+ * Build many small same lifetime objects from an arena and from the buddy
+ * pool directly, then release them all.
+ */
+static void bench_arena(void)
+{
+    const size_t rounds = 200;
+    const size_t objs = 10000;
+    static void *ptrs[10000];
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << 26);
+
+    double start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        struct buddy_arena *arena = buddy_arena_create(&pool, 16);
+        for (size_t i = 0; i < objs; i++) {
+            ptrs[i] = buddy_arena_alloc(arena, 16 + (i % 5) * 8, 0);
+        }
+        buddy_arena_destroy(arena);
+    }
+    double arena_ns = (now_ns() - start) / (double)(rounds * objs);
+
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < objs; i++) {
+            ptrs[i] = buddy_malloc(&pool, 16 + (i % 5) * 8);
+        }
+        for (size_t i = 0; i < objs; i++) {
+            buddy_free(&pool, ptrs[i]);
+        }
+    }
+    double buddy_ns = (now_ns() - start) / (double)(rounds * objs);
+
+    printf("arena/bump               %10.2f ns/obj\n", arena_ns);
+    printf("arena/buddy              %10.2f ns/obj\n", buddy_ns);
+    buddy_destroy(&pool);
+}
+
+/**
+ * Fill a pool with small objects of random size until it runs out, once on
+ * plain buddy blocks and once through the slab front end. Reports how much
+ * of the pool held requested bytes and the cost of each malloc and free.
+ */
+static void bench_small_objects(void)
+{
+    const size_t pool_k = 24;
+    static void *ptrs[UINT64_C(1) << 20];
+
+    for (int slab = 0; slab <= 1; slab++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << pool_k);
+        if (slab) {
+            buddy_slab_enable(&pool);
+        }
+        srand(42);
+        size_t n = 0;
+        size_t requested = 0;
+        double start = now_ns();
+        for (;;) {
+            size_t size = 16 + (size_t)rand() % 241;
+            void *p = buddy_malloc(&pool, size);
+            if (!p) {
+                break;
+            }
+            ptrs[n++] = p;
+            requested += size;
+        }
+        double alloc_ns = (now_ns() - start) / (double)n;
+        start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            buddy_free(&pool, ptrs[i]);
+        }
+        double free_ns = (now_ns() - start) / (double)n;
+        printf("small_objects/%-6s %9zu objs %6.1f%% used %8.2f ns/malloc %8.2f ns/free\n",
+               slab ? "slab" : "buddy", n, 100.0 * (double)requested / (double)pool.numbytes,
+               alloc_ns, free_ns);
+        buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Allocate and free a single 64 byte block from a fresh default sized pool
+ * with eager and with lazy coalescing.
+ */
+static void bench_ping_pong(void)
+{
+    const size_t iters = 2000000;
+    for (int lazy = 0; lazy <= 1; lazy++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, 0);
+        buddy_set_lazy(&pool, lazy ? 8 : 0);
+        double start = now_ns();
+        for (size_t i = 0; i < iters; i++) {
+            void *p = buddy_malloc(&pool, 40);
+            buddy_free(&pool, p);
+        }
+        double elapsed = now_ns() - start;
+        printf("ping_pong/%-6s         %10.2f ns/pair\n", lazy ? "lazy" : "eager", elapsed / iters);
+        buddy_destroy(&pool);
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print p50/p99/p99.9 of n latency samples, sorting them in place.
+ */
+static void print_percentiles(const char *name, double *lat, size_t n)
+{
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("%-24s p50 %8.0f ns  p99 %8.0f ns  p99.9 %8.0f ns\n", name,
+           lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000]);
+}
+
+/**
+ * Time every malloc and free of a random churn over three hot orders on a
+ * default sized pool, with and without real-time mode.
+ */
+static void bench_rt_latency(void)
+{
+    enum { SLOTS = 4096, OPS = 400000 };
+    static const size_t sizes[] = {40, 1000, 4000};
+    static void *slots[SLOTS];
+    static double malloc_lat[OPS];
+    static double free_lat[OPS];
+
+    for (int rt = 0; rt <= 1; rt++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, 0);
+        if (rt) {
+            buddy_rt_reserve(&pool, 6, 256);
+            buddy_rt_reserve(&pool, 10, 256);
+            buddy_rt_reserve(&pool, 12, 256);
+            buddy_rt_start(&pool, 50);
+            struct timespec settle = {0, 20000000};
+            nanosleep(&settle, NULL);
+        }
+        memset(slots, 0, sizeof(slots));
+        srand(7);
+        size_t nm = 0;
+        size_t nf = 0;
+        for (size_t i = 0; i < OPS; i++) {
+            size_t slot = (size_t)rand() % SLOTS;
+            double start = now_ns();
+            if (slots[slot]) {
+                buddy_free(&pool, slots[slot]);
+                free_lat[nf++] = now_ns() - start;
+                slots[slot] = NULL;
+            } else {
+                slots[slot] = buddy_malloc(&pool, sizes[(size_t)rand() % 3]);
+                malloc_lat[nm++] = now_ns() - start;
+            }
+        }
+        for (size_t i = 0; i < SLOTS; i++) {
+            buddy_free(&pool, slots[i]);
+        }
+        print_percentiles(rt ? "rt_latency/malloc/rt" : "rt_latency/malloc/off", malloc_lat, nm);
+        print_percentiles(rt ? "rt_latency/free/rt" : "rt_latency/free/off", free_lat, nf);
+        buddy_destroy(&pool);
+    }
+}
+
+/**
+ * @brief Resident set size of this process in bytes
+ */
+static size_t rss_bytes(void)
+{
+    long pages = 0;
+    long resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief The kval of the largest free block in the pool, 0 if it is full
+ */
+static size_t largest_free(struct buddy_pool *pool)
+{
+    for (size_t k = pool->kval_m; k > 0; k--) {
+        if (pool->avail[k].next != &pool->avail[k]) {
+            return k;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Bytes free in blocks of order k or larger
+ */
+static size_t free_above(struct buddy_pool *pool, size_t k)
+{
+    size_t bytes = 0;
+    for (; k <= pool->kval_m; k++) {
+        for (struct avail *b = pool->avail[k].next; b != &pool->avail[k]; b = b->next) {
+            bytes += UINT64_C(1) << k;
+        }
+    }
+    return bytes;
+}
+
+/**
+ * Run a long random workload of mixed sizes and lifetimes on a fresh
+ * mapping under each placement policy. Reports the pages the pool touched,
+ * the largest block still free and the highest address handed out.
+ */
+static void bench_placement(void)
+{
+    enum { SLOTS = 8192, OPS = 2000000 };
+    static void *slots[SLOTS];
+    static size_t sizes[SLOTS];
+    static const struct
+    {
+        const char *name;
+        int policy;
+    } policies[] = {
+        {"lifo", BUDDY_POLICY_LIFO},
+        {"address", BUDDY_POLICY_ADDRESS},
+        {"segregated", BUDDY_POLICY_SEGREGATED},
+    };
+
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        struct buddy_pool pool;
+        size_t rss = rss_bytes();
+        buddy_init(&pool, UINT64_C(1) << 25);
+        buddy_set_policy(&pool, policies[p].policy);
+        memset(slots, 0, sizeof(slots));
+        srand(11);
+        size_t top = 0;
+        size_t failures = 0;
+        for (size_t i = 0; i < OPS; i++) {
+            size_t slot = (size_t)rand() % SLOTS;
+            if (slots[slot]) {
+                buddy_free(&pool, slots[slot]);
+                slots[slot] = NULL;
+                continue;
+            }
+            //Mostly small objects with the odd large buffer
+            size_t size = rand() % 16 ? 16 + (size_t)rand() % 1000 : 4096 + (size_t)rand() % 60000;
+            char *mem = buddy_malloc(&pool, size);
+            if (!mem) {
+                failures++;
+                continue;
+            }
+            mem[0] = 1;
+            mem[size - 1] = 1;
+            slots[slot] = mem;
+            sizes[slot] = size;
+            size_t end = (size_t)(mem + size - (char *)pool.base);
+            top = end > top ? end : top;
+        }
+        size_t largest = largest_free(&pool);
+        //Drop the large buffers and see how much contiguous space the small objects left
+        for (size_t i = 0; i < SLOTS; i++) {
+            if (slots[i] && sizes[i] >= 4096) {
+                buddy_free(&pool, slots[i]);
+            }
+        }
+        printf("placement/%-10s rss %6.1f MiB  largest free 2^%zu (2^%zu small only)  top %6.1f MiB  failures %zu\n",
+               policies[p].name, (double)(rss_bytes() - rss) / (1 << 20), largest, largest_free(&pool),
+               (double)top / (1 << 20), failures);
+        buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Serve a stream of overlapping requests that each build short lived scratch
+ * buffers and replace one long lived object halfway through. Run with plain
+ * buddy_malloc and with lifetime hints. Reports the smallest share of free
+ * memory seen between requests that was in blocks of 64K or more.
+ */
+static void bench_lifetime(void)
+{
+    enum { REQUESTS = 100000, SCRATCH = 64, INFLIGHT = 8, KEEP = 32768 };
+    static void *kept[KEEP];
+    static void *scratch[INFLIGHT][SCRATCH];
+
+    for (int hinted = 0; hinted <= 1; hinted++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << 25);
+        memset(kept, 0, sizeof(kept));
+        memset(scratch, 0, sizeof(scratch));
+        srand(13);
+        double worst = 1.0;
+        size_t failures = 0;
+        double start = now_ns();
+        for (size_t r = 0; r < REQUESTS; r++) {
+            //The oldest request in flight finishes and a new one starts
+            void **req = scratch[r % INFLIGHT];
+            for (size_t i = 0; i < SCRATCH; i++) {
+                buddy_free(&pool, req[i]);
+            }
+            size_t avail = free_above(&pool, SMALLEST_K);
+            double usable = (double)free_above(&pool, 16) / (double)avail;
+            worst = usable < worst ? usable : worst;
+            for (size_t i = 0; i < SCRATCH; i++) {
+                size_t size = 32 + (size_t)rand() % 4000;
+                req[i] = hinted ? buddy_malloc_hint(&pool, size, BUDDY_HINT_SHORT)
+                                : buddy_malloc(&pool, size);
+                failures += req[i] == NULL;
+                if (i == SCRATCH / 2) {
+                    //Halfway through every request replaces one long lived object
+                    size_t slot = (size_t)rand() % KEEP;
+                    buddy_free(&pool, kept[slot]);
+                    size = 32 + (size_t)rand() % 480;
+                    kept[slot] = hinted ? buddy_malloc_hint(&pool, size, BUDDY_HINT_LONG)
+                                        : buddy_malloc(&pool, size);
+                }
+            }
+        }
+        double elapsed = now_ns() - start;
+        printf("lifetime/%-6s %10.0f requests/s  free in 64K+ blocks >= %5.1f%%  failures %zu\n",
+               hinted ? "hinted" : "plain", REQUESTS / (elapsed / 1e9), 100.0 * worst, failures);
+        for (size_t i = 0; i < KEEP; i++) {
+            buddy_free(&pool, kept[i]);
+        }
+        for (size_t r = 0; r < INFLIGHT; r++) {
+            for (size_t i = 0; i < SCRATCH; i++) {
+                buddy_free(&pool, scratch[r][i]);
+            }
+        }
+        buddy_destroy(&pool);
+    }
+}
+
+struct tree_node
+{
+    struct tree_node *left;
+    struct tree_node *right;
+    unsigned key;
+};
+
+/**
+ * @brief Sum the keys of a tree depth first, touching every node.
+ */
+static unsigned tree_sum(struct tree_node *node)
+{
+    unsigned sum = 0;
+    while (node) {
+        sum += node->key + tree_sum(node->left);
+        node = node->right;
+    }
+    return sum;
+}
+
+/**
+ * Age a pool by filling it with small objects and freeing three quarters of
+ * them in random order, then grow a random binary search tree in it and
+ * walk the tree depth first. Run with every node from buddy_malloc and with
+ * every node from buddy_malloc_near its parent. Every walk starts from a
+ * cache flushed by writing a buffer larger than the last level cache, so the
+ * walk pays for the layout of the tree and not for an earlier walk. Reports
+ * the time per node of the walk, the share of parent to child links within
+ * one 4K page and the per node counters that could be opened.
+ */
+static void bench_near(void)
+{
+    enum { NODES = 200000, AGED = 1 << 20, WALKS = 20, EVICT = 64 << 20 };
+    static void *aged[AGED];
+    char *evict = malloc(EVICT);
+    if (!evict) {
+        perror("bench_near");
+        return;
+    }
+    counters_open();
+
+    for (int near = 0; near <= 1; near++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << 28);
+        srand(17);
+        for (size_t i = 0; i < AGED; i++) {
+            aged[i] = buddy_malloc(&pool, 32 + (size_t)rand() % 100);
+        }
+        for (size_t i = AGED - 1; i > 0; i--) {
+            size_t j = (size_t)rand() % (i + 1);
+            void *tmp = aged[i];
+            aged[i] = aged[j];
+            aged[j] = tmp;
+        }
+        for (size_t i = 0; i < AGED / 4 * 3; i++) {
+            buddy_free(&pool, aged[i]);
+        }
+
+        struct tree_node *root = NULL;
+        size_t same_page = 0;
+        for (size_t n = 0; n < NODES; n++) {
+            unsigned key = (unsigned)rand();
+            struct tree_node *parent = NULL;
+            struct tree_node **link = &root;
+            while (*link) {
+                parent = *link;
+                link = key < parent->key ? &parent->left : &parent->right;
+            }
+            struct tree_node *node = near && parent ? buddy_malloc_near(&pool, sizeof(*node), parent)
+                                                    : buddy_malloc(&pool, sizeof(*node));
+            node->left = node->right = NULL;
+            node->key = key;
+            *link = node;
+            same_page += parent && ((uintptr_t)parent >> 12) == ((uintptr_t)node >> 12);
+        }
+        unsigned sum = 0;
+        double elapsed = 0;
+        double counts[NCOUNTERS];
+        counters_ioctl(PERF_EVENT_IOC_RESET);
+        for (int w = 0; w < WALKS; w++) {
+            memset(evict, w, EVICT);
+            double start = micro_begin();
+            sum += tree_sum(root);
+            elapsed += micro_end(start);
+        }
+        counters_read(counts);
+        printf("near/%-6s %14.2f ns/node  %5.1f%% links in one page  (sum %u)\n", near ? "near" : "plain",
+               elapsed / (double)(NODES * WALKS), 100.0 * (double)same_page / NODES, sum);
+        bool counted = false;
+        for (size_t j = 0; j < NCOUNTERS; j++) {
+            if (counts[j] >= 0) {
+                printf("  %s %.3f", counters[j].name, counts[j] / (double)(NODES * WALKS));
+                counted = true;
+            }
+        }
+        printf("%s", counted ? "  per node\n" : "");
+        buddy_destroy(&pool);
+    }
+    counters_close();
+    free(evict);
+}
+
+/**
+ * Sweep over many same size large buffers side by side, reading the same
+ * offset of every buffer before moving to the next line. Without coloring
+ * every buffer maps the offset to the same cache set. Run for several buffer
+ * sizes with coloring off and on.
+ */
+static void bench_colors(void)
+{
+    enum { BUFFERS = 64, SWEEPS = 20 };
+    static const size_t sizes[] = {UINT64_C(1) << 14, UINT64_C(1) << 16, UINT64_C(1) << 20};
+    char *bufs[BUFFERS];
+
+    for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+        //Leave room for the header and some colors in each block
+        size_t size = sizes[z] - sizes[z] / 8;
+        for (int colored = 0; colored <= 1; colored++) {
+            struct buddy_pool pool;
+            buddy_init(&pool, UINT64_C(1) << 28);
+            buddy_set_colors(&pool, colored ? 64 : 0);
+            for (size_t b = 0; b < BUFFERS; b++) {
+                bufs[b] = buddy_malloc(&pool, size);
+                memset(bufs[b], (int)b, size);
+            }
+            unsigned long sum = 0;
+            double start = now_ns();
+            for (int s = 0; s < SWEEPS; s++) {
+                for (size_t off = 0; off < size; off += 64) {
+                    for (size_t b = 0; b < BUFFERS; b++) {
+                        sum += (unsigned char)bufs[b][off];
+                    }
+                }
+            }
+            double elapsed = now_ns() - start;
+            char name[32];
+            snprintf(name, sizeof(name), "colors/%zuK/%s", sizes[z] >> 10, colored ? "on" : "off");
+            printf("%-24s %10.2f ns/line  (sum %lu)\n", name,
+                   elapsed / ((double)SWEEPS * BUFFERS * (double)(size / 64)), sum);
+            for (size_t b = 0; b < BUFFERS; b++) {
+                buddy_free(&pool, bufs[b]);
+            }
+            buddy_destroy(&pool);
+        }
+    }
+}
+
+/**
+ * Read files through a buffer from a pool that a churn of mixed size objects
+ * keeps fragmented. The fixed reader asks for a 1 MiB buffer and falls back
+ * to 4 KiB when that fails, the range reader takes whatever is free between
+ * the two. Reports first try failures, read calls and throughput.
+ */
+static void bench_range(void)
+{
+    enum { FILES = 2000, FILE_BYTES = 4 << 20, SLOTS = 8192 };
+    static void *slots[SLOTS];
+    int fd = open("/dev/zero", O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    for (int range = 0; range <= 1; range++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << 26);
+        memset(slots, 0, sizeof(slots));
+        srand(19);
+        size_t failures = 0;
+        size_t reads = 0;
+        double start = now_ns();
+        for (size_t f = 0; f < FILES; f++) {
+            for (int i = 0; i < 64; i++) {
+                size_t slot = (size_t)rand() % SLOTS;
+                if (slots[slot]) {
+                    buddy_free(&pool, slots[slot]);
+                    slots[slot] = NULL;
+                } else {
+                    slots[slot] = buddy_malloc(&pool, 1024 + (size_t)rand() % 30000);
+                }
+            }
+            size_t got = 1 << 20;
+            char *buf = range ? buddy_malloc_range(&pool, 4096, got, &got) : buddy_malloc(&pool, got);
+            if (!buf && !range) {
+                failures++;
+                got = 4096;
+                buf = buddy_malloc(&pool, got);
+            }
+            if (!buf) {
+                failures++;
+                continue;
+            }
+            for (size_t done = 0; done < FILE_BYTES; reads++) {
+                size_t want = FILE_BYTES - done < got ? FILE_BYTES - done : got;
+                ssize_t n = read(fd, buf, want);
+                if (n <= 0) {
+                    break;
+                }
+                done += (size_t)n;
+            }
+            buddy_free(&pool, buf);
+        }
+        double elapsed = now_ns() - start;
+        printf("range/%-6s %12.0f MiB/s  %8zu reads  %6zu failures\n", range ? "range" : "fixed",
+               (double)FILES * (FILE_BYTES >> 20) / (elapsed / 1e9), reads, failures);
+        buddy_destroy(&pool);
+    }
+    close(fd);
+}
+
+/**
+ * Build many strings by appending short pieces, growing each buffer by
+ * doubling. The plain builder only knows the capacity it asked for, the
+ * usable one starts from and grows to the usable size of its block.
+ * Reports reallocs per string and the time per append.
+ */
+static void bench_usable(void)
+{
+    enum { STRINGS = 20000, PIECES = 200 };
+    static const char piece[] = "appended text ";
+
+    for (int usable = 0; usable <= 1; usable++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << 26);
+        srand(23);
+        size_t reallocs = 0;
+        double start = now_ns();
+        for (size_t s = 0; s < STRINGS; s++) {
+            size_t cap = 16;
+            size_t len = 0;
+            char *str = usable ? buddy_malloc_usable(&pool, cap, &cap) : buddy_malloc(&pool, cap);
+            size_t pieces = 1 + (size_t)rand() % PIECES;
+            for (size_t p = 0; p < pieces; p++) {
+                size_t n = 1 + (size_t)rand() % (sizeof(piece) - 1);
+                if (len + n > cap) {
+                    cap *= 2;
+                    str = buddy_realloc(&pool, str, cap);
+                    if (usable) {
+                        cap = buddy_usable_size(&pool, str);
+                    }
+                    reallocs++;
+                }
+                memcpy(str + len, piece, n);
+                len += n;
+            }
+            buddy_free(&pool, str);
+        }
+        double elapsed = now_ns() - start;
+        printf("usable/%-6s %14.2f reallocs/string  %8.2f ns/append\n", usable ? "usable" : "plain",
+               (double)reallocs / STRINGS, elapsed / ((double)STRINGS * (PIECES + 1) / 2));
+        buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Free a large set of cold objects in random order with buddy_free and with
+ * buddy_free_sized. The caches are flushed before the frees so every header
+ * read is a likely miss.
+ */
+static void bench_free_sized(void)
+{
+    enum { OBJS = 1 << 19, FLUSH = 64 << 20 };
+    static void *ptrs[OBJS];
+    static size_t sizes[OBJS];
+    char *flush = malloc(FLUSH);
+    if (!flush) {
+        return;
+    }
+
+    for (int sized = 0; sized <= 1; sized++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << 30);
+        srand(29);
+        for (size_t i = 0; i < OBJS; i++) {
+            sizes[i] = 100 + (size_t)rand() % 1900;
+            ptrs[i] = buddy_malloc(&pool, sizes[i]);
+        }
+        for (size_t i = OBJS - 1; i > 0; i--) {
+            size_t j = (size_t)rand() % (i + 1);
+            void *p = ptrs[i];
+            size_t z = sizes[i];
+            ptrs[i] = ptrs[j];
+            sizes[i] = sizes[j];
+            ptrs[j] = p;
+            sizes[j] = z;
+        }
+        memset(flush, sized, FLUSH);
+        double start = now_ns();
+        for (size_t i = 0; i < OBJS; i++) {
+            if (sized) {
+                buddy_free_sized(&pool, ptrs[i], sizes[i]);
+            } else {
+                buddy_free(&pool, ptrs[i]);
+            }
+        }
+        double elapsed = now_ns() - start;
+        printf("free_sized/%-6s %10.2f ns/free\n", sized ? "sized" : "plain", elapsed / OBJS);
+        buddy_destroy(&pool);
+    }
+    free(flush);
+}
+
+/**
+ * Lazy ping-pong with tracing off and on, to show what leaving a trace
+ * running costs each call.
+ */
+static void bench_trace(void)
+{
+    const size_t iters = 2000000;
+    char path[] = "/tmp/bench-trace-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return;
+    }
+    close(fd);
+    for (int traced = 0; traced <= 1; traced++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, 0);
+        buddy_set_lazy(&pool, 8);
+        if (traced && buddy_trace_start(&pool, path, 1 << 20) == -1) {
+            buddy_destroy(&pool);
+            break;
+        }
+        double start = now_ns();
+        for (size_t i = 0; i < iters; i++) {
+            void *p = buddy_malloc(&pool, 40);
+            buddy_free(&pool, p);
+        }
+        double elapsed = now_ns() - start;
+        printf("trace/%-6s             %10.2f ns/pair\n", traced ? "on" : "off", elapsed / iters);
+        buddy_destroy(&pool);
+    }
+    unlink(path);
+}
+
+/**
+ * Random churn of mixed sizes with heap profiling off and on at the default
+ * rate, to show what leaving the profiler running costs each call.
+ */
+static void bench_profile(void)
+{
+    enum { SLOTS = 4096, OPS = 4000000 };
+    static void *slots[SLOTS];
+    for (int profiled = 0; profiled <= 1; profiled++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, 0);
+        buddy_set_lazy(&pool, 8);
+        if (profiled && buddy_profile_start(&pool, 0, NULL) == -1) {
+            buddy_destroy(&pool);
+            break;
+        }
+        srand(7);
+        double start = now_ns();
+        for (size_t i = 0; i < OPS; i++) {
+            size_t slot = (size_t)rand() % SLOTS;
+            if (slots[slot]) {
+                buddy_free(&pool, slots[slot]);
+                slots[slot] = NULL;
+            } else {
+                slots[slot] = buddy_malloc(&pool, 16 + (size_t)rand() % 4000);
+            }
+        }
+        double elapsed = now_ns() - start;
+        for (size_t i = 0; i < SLOTS; i++) {
+            buddy_free(&pool, slots[i]);
+            slots[i] = NULL;
+        }
+        printf("profile/%-6s           %10.2f ns/op\n", profiled ? "on" : "off", elapsed / OPS);
+        buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Microbenchmark suite. Each benchmark times ops calls of the allocator and
+ * returns the elapsed nanoseconds, keeping its setup and teardown outside
+ * the timed region. The harness runs it warmup times untimed, then reps
+ * times, and reports the spread of ns/op over the repetitions.
+ */
+struct micro
+{
+    const char *name;
+    double (*run)(size_t arg, size_t ops);
+    size_t arg;
+    size_t ops;
+};
+
+#define MICRO_MAX_REPS 1000
+#define MICRO_SLOTS 4096
+
+struct micro_result
+{
+    char name[64];
+    size_t ops;
+    double median;
+    double p10;
+    double p90;
+    double min;
+    double max;
+    double counts[NCOUNTERS];   /*Per op counts, -1 when not collected*/
+};
+
+/**
+ * @brief xorshift64, so every repetition sees the same sequence
+ */
+static uint64_t micro_rand(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Malloc and free one block filling order arg, ops pairs.
+ */
+static double micro_pingpong(size_t k, size_t ops)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, 0);
+    size_t size = (UINT64_C(1) << k) - sizeof(struct avail);
+    double start = micro_begin();
+    for (size_t i = 0; i < ops; i++) {
+        void *p = buddy_malloc(&pool, size);
+        buddy_free(&pool, p);
+    }
+    double elapsed = micro_end(start);
+    buddy_destroy(&pool);
+    return elapsed;
+}
+
+/**
+ * Flip random slots between a random sized block of up to arg bytes and
+ * free, so about half the slots are live.
+ */
+static double micro_churn(size_t max, size_t ops)
+{
+    static void *slots[MICRO_SLOTS];
+    struct buddy_pool pool;
+    buddy_init(&pool, 0);
+    uint64_t rng = 88172645463325252ULL;
+    double start = micro_begin();
+    for (size_t i = 0; i < ops; i++) {
+        size_t slot = micro_rand(&rng) % MICRO_SLOTS;
+        if (slots[slot]) {
+            buddy_free(&pool, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = buddy_malloc(&pool, 1 + micro_rand(&rng) % max);
+        }
+    }
+    double elapsed = micro_end(start);
+    for (size_t i = 0; i < MICRO_SLOTS; i++) {
+        buddy_free(&pool, slots[i]);
+        slots[i] = NULL;
+    }
+    buddy_destroy(&pool);
+    return elapsed;
+}
+
+/**
+ * Grow a buffer from 16 bytes by half its size per realloc up to arg bytes,
+ * then free it and start over, ops reallocs.
+ */
+static double micro_realloc(size_t limit, size_t ops)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, 0);
+    void *p = NULL;
+    size_t size = 16;
+    double start = micro_begin();
+    for (size_t i = 0; i < ops; i++) {
+        p = buddy_realloc(&pool, p, size);
+        size += size / 2;
+        if (size > limit) {
+            buddy_free(&pool, p);
+            p = NULL;
+            size = 16;
+        }
+    }
+    double elapsed = micro_end(start);
+    buddy_free(&pool, p);
+    buddy_destroy(&pool);
+    return elapsed;
+}
+
+/**
+ * Zeroed allocations of arg bytes, malloc plus memset then free, ops times.
+ */
+static double micro_calloc(size_t size, size_t ops)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, 0);
+    double start = micro_begin();
+    for (size_t i = 0; i < ops; i++) {
+        void *p = buddy_malloc(&pool, size);
+        memset(p, 0, size);
+        buddy_free(&pool, p);
+    }
+    double elapsed = micro_end(start);
+    buddy_destroy(&pool);
+    return elapsed;
+}
+
+/**
+ * Allocate arg blocks of mixed sizes, then free them all in allocation
+ * order, until ops mallocs and frees have been made.
+ */
+static double micro_batch(size_t count, size_t ops)
+{
+    static const size_t sizes[] = {40, 100, 200, 1000, 4000};
+    static void *ptrs[MICRO_SLOTS];
+    struct buddy_pool pool;
+    buddy_init(&pool, 0);
+    double start = micro_begin();
+    for (size_t done = 0; done < ops; done += 2 * count) {
+        for (size_t i = 0; i < count; i++) {
+            ptrs[i] = buddy_malloc(&pool, sizes[i % 5]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            buddy_free(&pool, ptrs[i]);
+        }
+    }
+    double elapsed = micro_end(start);
+    buddy_destroy(&pool);
+    return elapsed;
+}
+
+/**
+ * Initialize and destroy a pool of order arg, ops times, with the mapping
+ * cache left as configured, disabled unless the suite turned it on.
+ */
+static double micro_init_nocache(size_t k, size_t ops)
+{
+    double start = micro_begin();
+    for (size_t i = 0; i < ops; i++) {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << k);
+        buddy_destroy(&pool);
+    }
+    return micro_end(start);
+}
+
+/**
+ * @brief micro_init_nocache with the mapping cache turned on, so every
+ * cycle after the first reuses the same mapping
+ */
+static double micro_init(size_t k, size_t ops)
+{
+    buddy_cache_config(BUDDY_CACHE_DEFAULT, BUDDY_CACHE_KEEP);
+    double elapsed = micro_init_nocache(k, ops);
+    buddy_cache_flush();
+    buddy_cache_config(0, BUDDY_CACHE_KEEP);
+    return elapsed;
+}
+
+static const struct micro micros[] = {
+    {"pingpong/k6", micro_pingpong, 6, 200000},
+    {"pingpong/k8", micro_pingpong, 8, 200000},
+    {"pingpong/k10", micro_pingpong, 10, 200000},
+    {"pingpong/k12", micro_pingpong, 12, 200000},
+    {"pingpong/k14", micro_pingpong, 14, 200000},
+    {"pingpong/k16", micro_pingpong, 16, 200000},
+    {"pingpong/k20", micro_pingpong, 20, 100000},
+    {"churn/256", micro_churn, 256, 200000},
+    {"churn/8192", micro_churn, 8192, 200000},
+    {"realloc/64K", micro_realloc, 64 << 10, 100000},
+    {"realloc/4M", micro_realloc, 4 << 20, 50000},
+    {"calloc/64", micro_calloc, 64, 200000},
+    {"calloc/4K", micro_calloc, 4 << 10, 50000},
+    {"calloc/64K", micro_calloc, 64 << 10, 5000},
+    {"batch/256", micro_batch, 256, 204800},
+    {"batch/4096", micro_batch, 4096, 204800},
+    {"init/k24", micro_init, 24, 20000},
+    {"init/k30", micro_init, 30, 20000},
+    {"init/k30/nocache", micro_init_nocache, 30, 2000},
+};
+
+/**
+ * @brief Percentile p of n sorted samples, interpolating between ranks
+ */
+static double percentile(const double *sorted, size_t n, double p)
+{
+    double rank = p / 100.0 * (double)(n - 1);
+    size_t lo = (size_t)rank;
+    size_t hi = lo + 1 < n ? lo + 1 : lo;
+    return sorted[lo] + (rank - (double)lo) * (sorted[hi] - sorted[lo]);
+}
+
+/**
+ * @brief Run one microbenchmark and fill in its result
+ */
+static void micro_measure(const struct micro *m, size_t warmup, size_t reps, double *samples,
+                          struct micro_result *out)
+{
+    for (size_t i = 0; i < warmup; i++) {
+        m->run(m->arg, m->ops);
+    }
+    counters_ioctl(PERF_EVENT_IOC_RESET);
+    for (size_t i = 0; i < reps; i++) {
+        samples[i] = m->run(m->arg, m->ops) / (double)m->ops;
+    }
+    counters_read(out->counts);
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        out->counts[i] = out->counts[i] < 0 ? -1 : out->counts[i] / (double)(reps * m->ops);
+    }
+    snprintf(out->name, sizeof(out->name), "%s", m->name);
+    out->ops = m->ops;
+    double sorted[MICRO_MAX_REPS];
+    memcpy(sorted, samples, reps * sizeof(double));
+    qsort(sorted, reps, sizeof(double), cmp_double);
+    out->median = percentile(sorted, reps, 50);
+    out->p10 = percentile(sorted, reps, 10);
+    out->p90 = percentile(sorted, reps, 90);
+    out->min = sorted[0];
+    out->max = sorted[reps - 1];
+}
+
+/**
+ * Run the suite, printing a table and writing JSON to json unless it is
+ * NULL. The JSON keeps one benchmark per line so --compare can read it back
+ * without a full parser.
+ */
+static int micro_suite(const char *json, const char *filter, size_t warmup, size_t reps, int count)
+{
+    if (count && !counters_open()) {
+        fprintf(stderr, "no performance counters available, timing only\n");
+    }
+    FILE *out = NULL;
+    if (json && !(out = fopen(json, "w"))) {
+        perror(json);
+        return EXIT_FAILURE;
+    }
+    if (out) {
+        fprintf(out, "{\n  \"suite\": \"bench-lab\",\n  \"unit\": \"ns/op\",\n");
+        fprintf(out, "  \"warmup\": %zu,\n  \"reps\": %zu,\n  \"benchmarks\": [", warmup, reps);
+    }
+    static double samples[MICRO_MAX_REPS];
+    const char *sep = "\n";
+    for (size_t i = 0; i < sizeof(micros) / sizeof(micros[0]); i++) {
+        if (filter && !strstr(micros[i].name, filter)) {
+            continue;
+        }
+        struct micro_result r;
+        micro_measure(&micros[i], warmup, reps, samples, &r);
+        printf("%-20s median %10.2f ns/op  p10 %10.2f  p90 %10.2f\n", r.name, r.median, r.p10, r.p90);
+        for (size_t j = 0; j < NCOUNTERS; j++) {
+            if (r.counts[j] >= 0) {
+                printf("%s%s %.2f", j ? "  " : "", counters[j].name, r.counts[j]);
+            }
+        }
+        printf("%s", count ? "  per op\n" : "");
+        fflush(stdout);
+        if (out) {
+            fprintf(out, "%s    {\"name\": \"%s\", \"ops\": %zu, \"median\": %.3f, \"p10\": %.3f, "
+                    "\"p90\": %.3f, \"min\": %.3f, \"max\": %.3f, ",
+                    sep, r.name, r.ops, r.median, r.p10, r.p90, r.min, r.max);
+            for (size_t j = 0; j < NCOUNTERS; j++) {
+                if (r.counts[j] >= 0) {
+                    fprintf(out, "\"%s\": %.3f, ", counters[j].name, r.counts[j]);
+                }
+            }
+            fprintf(out, "\"samples\": [");
+            for (size_t j = 0; j < reps; j++) {
+                fprintf(out, "%s%.3f", j ? ", " : "", samples[j]);
+            }
+            fprintf(out, "]}");
+            sep = ",\n";
+        }
+    }
+    if (out) {
+        fprintf(out, "\n  ]\n}\n");
+        fclose(out);
+    }
+    counters_close();
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Read the benchmarks of a JSON file written by micro_suite
+ */
+static size_t micro_load(const char *path, struct micro_result *res, size_t max)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 0;
+    }
+    char line[16384];
+    size_t n = 0;
+    while (n < max && fgets(line, sizeof(line), f)) {
+        char *name = strstr(line, "\"name\": \"");
+        char *median = strstr(line, "\"median\": ");
+        char *p10 = strstr(line, "\"p10\": ");
+        char *p90 = strstr(line, "\"p90\": ");
+        if (!name || !median || !p10 || !p90 ||
+            sscanf(name, "\"name\": \"%63[^\"]\"", res[n].name) != 1) {
+            continue;
+        }
+        res[n].median = strtod(median + 10, NULL);
+        res[n].p10 = strtod(p10 + 7, NULL);
+        res[n].p90 = strtod(p90 + 7, NULL);
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+/**
+ * Diff two JSON runs by median. A benchmark regressed when its median got
+ * slower by more than threshold percent and the middle 80% of the two runs
+ * do not overlap, so a single noisy repetition does not fail the gate.
+ * Returns EXIT_FAILURE when anything regressed.
+ */
+static int micro_compare(const char *old_path, const char *new_path, double threshold)
+{
+    static struct micro_result olds[256];
+    static struct micro_result news[256];
+    size_t nold = micro_load(old_path, olds, 256);
+    size_t nnew = micro_load(new_path, news, 256);
+    if (!nold || !nnew) {
+        fprintf(stderr, "no benchmarks to compare\n");
+        return EXIT_FAILURE;
+    }
+    size_t regressions = 0;
+    printf("%-20s %12s %12s %9s\n", "benchmark", "old ns/op", "new ns/op", "change");
+    for (size_t i = 0; i < nnew; i++) {
+        const struct micro_result *o = NULL;
+        for (size_t j = 0; j < nold && !o; j++) {
+            o = strcmp(olds[j].name, news[i].name) ? NULL : &olds[j];
+        }
+        if (!o) {
+            printf("%-20s %12s %12.2f %9s\n", news[i].name, "-", news[i].median, "new");
+            continue;
+        }
+        double change = 100.0 * (news[i].median - o->median) / o->median;
+        const char *verdict = "";
+        if (change > threshold && news[i].p10 > o->p90) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (change < -threshold && news[i].p90 < o->p10) {
+            verdict = "improved";
+        }
+        printf("%-20s %12.2f %12.2f %+8.1f%% %s\n", news[i].name, o->median, news[i].median, change, verdict);
+    }
+    for (size_t j = 0; j < nold; j++) {
+        size_t i = 0;
+        while (i < nnew && strcmp(olds[j].name, news[i].name)) {
+            i++;
+        }
+        if (i == nnew) {
+            printf("%-20s %12.2f %12s %9s\n", olds[j].name, olds[j].median, "-", "removed");
+        }
+    }
+    printf("%zu regression%s over %.1f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Multithreaded scaling. A pool is not thread safe on its own, so every
+ * workload runs against one pool behind a single global mutex, against one
+ * pool per thread each behind its own mutex with frees routed to the pool
+ * owning the pointer, and against glibc malloc for reference.
+ */
+#define MT_MAX_THREADS 64
+#define MT_POOL_K 28
+#define LARSON_SLOTS 1024
+#define LARSON_ROUND 4096
+#define CHURN_SLOTS 1024
+#define RING_SLOTS 1024
+
+struct mt_alloc
+{
+    const char *name;
+    void (*setup)(size_t threads);
+    void (*teardown)(size_t threads);
+    void *(*alloc)(size_t thread, size_t size);
+    void (*release)(size_t thread, void *ptr);
+};
+
+static struct buddy_pool mt_pool;
+static pthread_mutex_t mt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mt_shard
+{
+    struct buddy_pool pool;
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) mt_shards[MT_MAX_THREADS];
+static size_t mt_nshards;
+
+static void mutex_setup(size_t threads)
+{
+    (void)threads;
+    buddy_init(&mt_pool, 0);
+}
+
+static void mutex_teardown(size_t threads)
+{
+    (void)threads;
+    buddy_destroy(&mt_pool);
+}
+
+static void *mutex_alloc(size_t thread, size_t size)
+{
+    (void)thread;
+    pthread_mutex_lock(&mt_lock);
+    void *p = buddy_malloc(&mt_pool, size);
+    pthread_mutex_unlock(&mt_lock);
+    return p;
+}
+
+static void mutex_release(size_t thread, void *ptr)
+{
+    (void)thread;
+    pthread_mutex_lock(&mt_lock);
+    buddy_free(&mt_pool, ptr);
+    pthread_mutex_unlock(&mt_lock);
+}
+
+static void sharded_setup(size_t threads)
+{
+    for (size_t i = 0; i < threads; i++) {
+        buddy_init(&mt_shards[i].pool, UINT64_C(1) << MT_POOL_K);
+        pthread_mutex_init(&mt_shards[i].lock, NULL);
+    }
+    mt_nshards = threads;
+}
+
+static void sharded_teardown(size_t threads)
+{
+    for (size_t i = 0; i < threads; i++) {
+        buddy_destroy(&mt_shards[i].pool);
+        pthread_mutex_destroy(&mt_shards[i].lock);
+    }
+    mt_nshards = 0;
+}
+
+static void *sharded_alloc(size_t thread, size_t size)
+{
+    struct mt_shard *s = &mt_shards[thread];
+    pthread_mutex_lock(&s->lock);
+    void *p = buddy_malloc(&s->pool, size);
+    pthread_mutex_unlock(&s->lock);
+    return p;
+}
+
+static void sharded_release(size_t thread, void *ptr)
+{
+    (void)thread;
+    if (!ptr) {
+        return;
+    }
+    for (size_t i = 0; i < mt_nshards; i++) {
+        struct mt_shard *s = &mt_shards[i];
+        if ((char *)ptr >= (char *)s->pool.base && (char *)ptr < (char *)s->pool.base + s->pool.numbytes) {
+            pthread_mutex_lock(&s->lock);
+            buddy_free(&s->pool, ptr);
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+    }
+}
+
+static void libc_setup(size_t threads)
+{
+    (void)threads;
+}
+
+static void libc_teardown(size_t threads)
+{
+    (void)threads;
+}
+
+static void *libc_alloc(size_t thread, size_t size)
+{
+    (void)thread;
+    return malloc(size);
+}
+
+static void libc_release(size_t thread, void *ptr)
+{
+    (void)thread;
+    free(ptr);
+}
+
+static const struct mt_alloc mt_allocs[] = {
+    {"mutex", mutex_setup, mutex_teardown, mutex_alloc, mutex_release},
+    {"sharded", sharded_setup, sharded_teardown, sharded_alloc, sharded_release},
+    {"libc", libc_setup, libc_teardown, libc_alloc, libc_release},
+};
+
+struct mt_thread
+{
+    const struct mt_alloc *a;
+    size_t index;
+    size_t threads;
+    size_t ops;
+    uint64_t rng;
+    pthread_t tid;
+};
+
+static pthread_barrier_t mt_barrier;
+static void *larson_slots[MT_MAX_THREADS][LARSON_SLOTS];
+
+static struct mt_ring
+{
+    _Atomic size_t head;
+    char pad[56];
+    _Atomic size_t tail;
+    void *items[RING_SLOTS];
+} __attribute__((aligned(64))) mt_rings[MT_MAX_THREADS / 2];
+
+/**
+ * Larson: every thread replaces random objects in a set of its own, and
+ * after each round the sets move on to the next thread, so most frees are
+ * of objects another thread allocated, as in a server handing requests
+ * between workers.
+ */
+static void larson_body(struct mt_thread *t)
+{
+    void **mine = larson_slots[t->index];
+    for (size_t i = 0; i < LARSON_SLOTS; i++) {
+        mine[i] = t->a->alloc(t->index, 16 + micro_rand(&t->rng) % 1009);
+    }
+    pthread_barrier_wait(&mt_barrier);
+    for (size_t round = 0; round * LARSON_ROUND * 2 < t->ops; round++) {
+        void **set = larson_slots[(t->index + round) % t->threads];
+        for (size_t i = 0; i < LARSON_ROUND; i++) {
+            size_t slot = micro_rand(&t->rng) % LARSON_SLOTS;
+            t->a->release(t->index, set[slot]);
+            set[slot] = t->a->alloc(t->index, 16 + micro_rand(&t->rng) % 1009);
+        }
+        pthread_barrier_wait(&mt_barrier);
+    }
+    pthread_barrier_wait(&mt_barrier);
+    for (size_t i = 0; i < LARSON_SLOTS; i++) {
+        t->a->release(t->index, mine[i]);
+        mine[i] = NULL;
+    }
+}
+
+/**
+ * Thread-local churn: random malloc and free over a set no other thread
+ * touches.
+ */
+static void churn_body(struct mt_thread *t)
+{
+    void *slots[CHURN_SLOTS] = {0};
+    pthread_barrier_wait(&mt_barrier);
+    for (size_t i = 0; i < t->ops; i++) {
+        size_t slot = micro_rand(&t->rng) % CHURN_SLOTS;
+        if (slots[slot]) {
+            t->a->release(t->index, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = t->a->alloc(t->index, 16 + micro_rand(&t->rng) % 1009);
+        }
+    }
+    pthread_barrier_wait(&mt_barrier);
+    for (size_t i = 0; i < CHURN_SLOTS; i++) {
+        t->a->release(t->index, slots[i]);
+    }
+}
+
+/**
+ * Producer/consumer: even threads allocate and hand every object through a
+ * single producer single consumer ring to the next odd thread, which frees
+ * it. A lone thread fills the ring and drains it itself.
+ */
+static void prodcons_body(struct mt_thread *t)
+{
+    struct mt_ring *ring = &mt_rings[t->index / 2];
+    pthread_barrier_wait(&mt_barrier);
+    if (t->threads == 1) {
+        for (size_t done = 0; done < t->ops; done += 2 * RING_SLOTS) {
+            for (size_t i = 0; i < RING_SLOTS; i++) {
+                ring->items[i] = t->a->alloc(t->index, 16 + micro_rand(&t->rng) % 1009);
+            }
+            for (size_t i = 0; i < RING_SLOTS; i++) {
+                t->a->release(t->index, ring->items[i]);
+            }
+        }
+    } else if (t->index % 2 == 0) {
+        for (size_t i = 0; i < t->ops; i++) {
+            void *p = t->a->alloc(t->index, 16 + micro_rand(&t->rng) % 1009);
+            size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SLOTS) {
+                sched_yield();
+            }
+            ring->items[head % RING_SLOTS] = p;
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        }
+    } else {
+        for (size_t i = 0; i < t->ops; i++) {
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+                sched_yield();
+            }
+            void *p = ring->items[tail % RING_SLOTS];
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+            t->a->release(t->index, p);
+        }
+    }
+    pthread_barrier_wait(&mt_barrier);
+}
+
+static struct
+{
+    const char *name;
+    void (*body)(struct mt_thread *t);
+    int pairs;
+} const mt_workloads[] = {
+    {"larson", larson_body, 0},
+    {"churn", churn_body, 0},
+    {"prodcons", prodcons_body, 1},
+};
+static size_t mt_workload;
+
+static void *mt_main(void *arg)
+{
+    mt_workloads[mt_workload].body(arg);
+    return NULL;
+}
+
+/**
+ * Run one workload on threads threads with ops malloc and free calls each.
+ * The clock runs from the barrier every thread passes once its setup is
+ * done to the one it passes when its share is finished.
+ */
+static double mt_run(const struct mt_alloc *a, size_t threads, size_t ops)
+{
+    static struct mt_thread t[MT_MAX_THREADS];
+    a->setup(threads);
+    memset(mt_rings, 0, sizeof(mt_rings));
+    pthread_barrier_init(&mt_barrier, NULL, (unsigned)threads + 1);
+    for (size_t i = 0; i < threads; i++) {
+        t[i] = (struct mt_thread){a, i, threads, ops, 0x9E3779B97F4A7C15ULL * (i + 1), 0};
+        int rval = pthread_create(&t[i].tid, NULL, mt_main, &t[i]);
+        if (rval) {
+            //The threads already started wait on the barrier for this one
+            //and the workloads need every thread, so there is no going on
+            fprintf(stderr, "pthread_create thread %zu of %zu: %s\n", i + 1, threads, strerror(rval));
+            exit(EXIT_FAILURE);
+        }
+    }
+    //Larson threads meet once more per round, the main thread has to as well
+    size_t rounds = mt_workloads[mt_workload].body == larson_body ? (ops + 2 * LARSON_ROUND - 1) / (2 * LARSON_ROUND) : 0;
+    pthread_barrier_wait(&mt_barrier);
+    double start = now_ns();
+    for (size_t i = 0; i < rounds; i++) {
+        pthread_barrier_wait(&mt_barrier);
+    }
+    pthread_barrier_wait(&mt_barrier);
+    double elapsed = now_ns() - start;
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(t[i].tid, NULL);
+    }
+    pthread_barrier_destroy(&mt_barrier);
+    a->teardown(threads);
+    return (double)(threads * ops) / elapsed * 1e9;
+}
+
+/**
+ * Run every workload from one thread up to max threads, doubling, and
+ * report ops/s and the scaling efficiency against one thread.
+ */
+static void scaling(size_t max)
+{
+    const size_t ops = 1000000;
+    for (mt_workload = 0; mt_workload < sizeof(mt_workloads) / sizeof(mt_workloads[0]); mt_workload++) {
+        for (size_t a = 0; a < sizeof(mt_allocs) / sizeof(mt_allocs[0]); a++) {
+            double single = 0;
+            for (size_t n = 1; n <= max; n = n * 2 > max && n < max ? max : n * 2) {
+                size_t threads = mt_workloads[mt_workload].pairs && n > 1 ? n & ~(size_t)1 : n;
+                double rate = mt_run(&mt_allocs[a], threads, ops);
+                single = n == 1 ? rate : single;
+                printf("%-8s/%-8s threads %3zu  %8.2f Mops/s  efficiency %5.2f\n", mt_workloads[mt_workload].name,
+                       mt_allocs[a].name, threads, rate / 1e6, rate / (single * (double)threads));
+                fflush(stdout);
+            }
+        }
+    }
+}
+
+/**
+ * Long running fragmentation run. Every step allocates one object and frees
+ * the ones whose lifetime has run out, with time counted in allocations.
+ * Sizes are lognormal around 64 bytes with 1% large buffers of up to 1 MiB.
+ * Lifetimes mix 60% short (exponential, mean 50), 30% medium (exponential,
+ * mean 5000) and 10% long (Pareto, alpha 1.2 from 20000), so the live set
+ * settles while a heavy tail keeps pinning old blocks in place. Objects have
+ * every page written once so RSS follows what the pool hands out.
+ */
+struct frag_options
+{
+    const char *csv;
+    uint64_t ops;
+    double seconds;
+    uint64_t interval;
+    uint64_t seed;
+    int policy;
+    size_t lazy;
+    size_t pool_k;
+};
+
+struct frag_obj
+{
+    uint64_t death;
+    void *ptr;
+};
+
+static double frag_unit(uint64_t *rng)
+{
+    return ((double)(micro_rand(rng) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static size_t frag_size(uint64_t *rng)
+{
+    if (micro_rand(rng) % 100 == 0) {
+        return (64 << 10) + micro_rand(rng) % (960 << 10);
+    }
+    double normal = sqrt(-2.0 * log(frag_unit(rng))) * cos(2.0 * M_PI * frag_unit(rng));
+    double bytes = exp(log(64.0) + 1.5 * normal);
+    return bytes < 1.0 ? 1 : bytes > 65536.0 ? 65536 : (size_t)bytes;
+}
+
+static uint64_t frag_lifetime(uint64_t *rng)
+{
+    uint64_t pick = micro_rand(rng) % 10;
+    double u = frag_unit(rng);
+    if (pick < 6) {
+        return 1 + (uint64_t)(-50.0 * log(u));
+    }
+    if (pick < 9) {
+        return 1 + (uint64_t)(-5000.0 * log(u));
+    }
+    double life = 20000.0 / pow(u, 1.0 / 1.2);
+    return life > 1e12 ? (uint64_t)1e12 : (uint64_t)life;
+}
+
+/**
+ * @brief Push onto the min-heap of live objects ordered by death
+ */
+static void frag_push(struct frag_obj *heap, size_t *n, struct frag_obj obj)
+{
+    size_t i = (*n)++;
+    while (i && heap[(i - 1) / 2].death > obj.death) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = obj;
+}
+
+/**
+ * @brief Pop the live object that dies first
+ */
+static struct frag_obj frag_pop(struct frag_obj *heap, size_t *n)
+{
+    struct frag_obj top = heap[0];
+    struct frag_obj last = heap[--*n];
+    size_t i = 0;
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= *n) {
+            break;
+        }
+        if (c + 1 < *n && heap[c + 1].death < heap[c].death) {
+            c++;
+        }
+        if (last.death <= heap[c].death) {
+            break;
+        }
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/**
+ * @brief Write one CSV row of the pool's fragmentation
+ */
+static void frag_sample(FILE *out, struct buddy_pool *pool, uint64_t step, double seconds, size_t live,
+                        uint64_t allocs, uint64_t failures)
+{
+    struct buddy_stats st;
+    buddy_stats(pool, &st);
+    size_t free_bytes = 0;
+    size_t parked_bytes = 0;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        free_bytes += st.free_blocks[k] << k;
+        parked_bytes += st.parked_blocks[k] << k;
+    }
+    fprintf(out, "%" PRIu64 ",%.3f,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%" PRIu64 ",%.6f,%zu", step, seconds, live,
+            st.requested, st.reserved, free_bytes, parked_bytes, st.largest_free,
+            st.largest_free ? (size_t)1 << st.largest_free : 0, failures,
+            allocs ? (double)failures / (double)allocs : 0.0, rss_bytes());
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        fprintf(out, ",%zu", st.free_blocks[k] << k);
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+/**
+ * Run the fragmentation workload and write a CSV row every interval
+ * allocations: live objects, requested, reserved, free and parked bytes,
+ * the largest free block, failures and the failure rate over the interval,
+ * the process RSS and the free bytes of every order.
+ */
+static int fragmentation(const struct frag_options *opt)
+{
+    FILE *out = opt->csv ? fopen(opt->csv, "w") : stdout;
+    if (!out) {
+        perror(opt->csv);
+        return EXIT_FAILURE;
+    }
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << opt->pool_k);
+    if (buddy_set_policy(&pool, opt->policy) == -1) {
+        perror("buddy_set_policy");
+        buddy_destroy(&pool);
+        return EXIT_FAILURE;
+    }
+    buddy_set_lazy(&pool, opt->lazy);
+
+    size_t cap = 1 << 16;
+    size_t live = 0;
+    struct frag_obj *heap = malloc(cap * sizeof(struct frag_obj));
+    if (!heap) {
+        perror("malloc");
+        buddy_destroy(&pool);
+        if (out != stdout) {
+            fclose(out);
+        }
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    uint64_t rng = opt->seed ? opt->seed : 1;
+    uint64_t allocs = 0;
+    uint64_t failures = 0;
+    fprintf(out, "ops,seconds,live_objects,requested_bytes,reserved_bytes,free_bytes,parked_bytes,"
+            "largest_free_k,largest_free_bytes,failures,failure_rate,rss_bytes");
+    for (size_t k = SMALLEST_K; k <= pool.kval_m; k++) {
+        fprintf(out, ",free_k%zu", k);
+    }
+    fprintf(out, "\n");
+
+    double start = now_ns();
+    double seconds = 0;
+    uint64_t step;
+    for (step = 1; step <= opt->ops && (!opt->seconds || seconds < opt->seconds); step++) {
+        while (live && heap[0].death <= step) {
+            buddy_free(&pool, frag_pop(heap, &live).ptr);
+        }
+        size_t size = frag_size(&rng);
+        char *p = buddy_malloc(&pool, size);
+        for (size_t off = 0; p && off < size; off += 4096) {
+            p[off] = 1; //Touch every page like a real program would
+        }
+        uint64_t life = frag_lifetime(&rng);
+        allocs++;
+        if (!p) {
+            failures++;
+        } else {
+            if (live == cap) {
+                struct frag_obj *grown = realloc(heap, 2 * cap * sizeof(struct frag_obj));
+                if (!grown) {
+                    perror("realloc");
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                heap = grown;
+                cap *= 2;
+            }
+            frag_push(heap, &live, (struct frag_obj){step + life, p});
+        }
+        if (step % opt->interval == 0) {
+            seconds = (now_ns() - start) / 1e9;
+            frag_sample(out, &pool, step, seconds, live, allocs, failures);
+            allocs = 0;
+            failures = 0;
+        }
+    }
+    while (live) {
+        buddy_free(&pool, frag_pop(heap, &live).ptr);
+    }
+    free(heap);
+    buddy_destroy(&pool);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return status;
+}
+
+/**
+ * @brief The longer experiments that each report on one allocator feature
+ */
+static void reports(void)
+{
+    bench_pool_churn();
+    bench_arena();
+    bench_small_objects();
+    bench_ping_pong();
+    bench_rt_latency();
+    bench_placement();
+    bench_lifetime();
+    bench_near();
+    bench_colors();
+    bench_range();
+    bench_usable();
+    bench_free_sized();
+    bench_trace();
+    bench_profile();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [--json FILE] [--filter NAME] [--warmup N] [--reps N] [--counters]\n"
+            "       %s --compare OLD.json NEW.json [--threshold PCT]\n"
+            "       %s --reports\n"
+            "       %s --scaling [--max-threads N]\n"
+            "       %s --fragmentation [--csv FILE] [--ops N] [--seconds S] [--interval N]\n"
+            "                 [--seed N] [--policy lifo|address|segregated] [--lazy N] [--pool-k K]\n",
+            prog, prog, prog, prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longopts[] = {
+        {"json", required_argument, NULL, 'j'},
+        {"filter", required_argument, NULL, 'f'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"reps", required_argument, NULL, 'r'},
+        {"counters", no_argument, NULL, 'P'},
+        {"compare", no_argument, NULL, 'c'},
+        {"threshold", required_argument, NULL, 't'},
+        {"reports", no_argument, NULL, 'R'},
+        {"scaling", no_argument, NULL, 's'},
+        {"max-threads", required_argument, NULL, 'm'},
+        {"fragmentation", no_argument, NULL, 'F'},
+        {"csv", required_argument, NULL, 'C'},
+        {"ops", required_argument, NULL, 'o'},
+        {"seconds", required_argument, NULL, 'S'},
+        {"interval", required_argument, NULL, 'i'},
+        {"seed", required_argument, NULL, 'e'},
+        {"policy", required_argument, NULL, 'p'},
+        {"lazy", required_argument, NULL, 'l'},
+        {"pool-k", required_argument, NULL, 'k'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    const char *json = NULL;
+    const char *filter = NULL;
+    size_t warmup = 2;
+    size_t reps = 15;
+    double threshold = 5.0;
+    // One thread per core by default, as many as the workloads have room for
+    size_t max_threads = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads > MT_MAX_THREADS) {
+        max_threads = MT_MAX_THREADS;
+    }
+    int compare = 0;
+    int scale = 0;
+    int frag = 0;
+    int count = 0;
+    struct frag_options fopt = {NULL, 20000000, 0, 100000, 1, BUDDY_POLICY_LIFO, 0, 28};
+    int c;
+    while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'j': json = optarg; break;
+        case 'f': filter = optarg; break;
+        case 'w': warmup = strtoull(optarg, NULL, 0); break;
+        case 'r': reps = strtoull(optarg, NULL, 0); break;
+        case 'c': compare = 1; break;
+        case 'P': count = 1; break;
+        case 't': threshold = strtod(optarg, NULL); break;
+        case 's': scale = 1; break;
+        case 'm': max_threads = strtoull(optarg, NULL, 0); break;
+        case 'F': frag = 1; break;
+        case 'C': fopt.csv = optarg; break;
+        case 'o': fopt.ops = strtoull(optarg, NULL, 0); break;
+        case 'S': fopt.seconds = strtod(optarg, NULL); break;
+        case 'i': fopt.interval = strtoull(optarg, NULL, 0); break;
+        case 'e': fopt.seed = strtoull(optarg, NULL, 0); break;
+        case 'p':
+            fopt.policy = !strcmp(optarg, "address") ? BUDDY_POLICY_ADDRESS
+                        : !strcmp(optarg, "segregated") ? BUDDY_POLICY_SEGREGATED
+                        : !strcmp(optarg, "lifo") ? BUDDY_POLICY_LIFO : -1;
+            break;
+        case 'l': fopt.lazy = strtoull(optarg, NULL, 0); break;
+        case 'k': fopt.pool_k = strtoull(optarg, NULL, 0); break;
+        case 'R':
+            reports();
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (frag) {
+        if (!fopt.interval || fopt.policy < 0 || fopt.pool_k < MIN_K || fopt.pool_k >= MAX_K) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return fragmentation(&fopt);
+    }
+    if (scale) {
+        if (!max_threads || max_threads > MT_MAX_THREADS) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        scaling(max_threads);
+        return EXIT_SUCCESS;
+    }
+    if (compare) {
+        if (argc - optind != 2) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return micro_compare(argv[optind], argv[optind + 1], threshold);
+    }
+    if (!reps || reps > MICRO_MAX_REPS || optind != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    return micro_suite(json, filter, warmup, reps, count);
+}
@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE //pthread_getattr_np for the heap profiler's stack bounds
+#endif
 #include <stdio.h>
 #include <stdbool.h>
 #include <sys/mman.h>
@@ -8,11 +11,22 @@
 #include <execinfo.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <math.h>
+#include <limits.h>
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
 #include <errno.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "lab.h"
 
@@ -54,72 +68,466 @@ struct avail *buddy_calc(struct buddy_pool *pool, struct avail *buddy)
     return (struct avail *)((address ^ operand) + (size_t)pool->base);
 }
 
-void *buddy_malloc(struct buddy_pool *pool, size_t size)
+/**
+ * The most summary levels an order bitmap can need. 64^7 bits covers any
+ * pool up to MAX_K.
+ */
+#define INDEX_LEVELS 8
+
+/**
+ * Returned by the index searches when there is no free block.
+ */
+#define INDEX_NONE SIZE_MAX
+
+/**
+ * @brief Address index of the free blocks. For every order there is a bitmap
+ * with one bit per possible block of that order, set while the block is on
+ * its avail list. Each bitmap has summary levels above it where a bit is set
+ * when the word below is not zero, so the lowest or highest free block of
+ * an order is found in a handful of word reads.
+ */
+struct buddy_index
 {
-    if (!pool || size == 0) {
-        errno = EINVAL; // Invalid input
-        return NULL;
+    uint64_t *level[MAX_K][INDEX_LEVELS];   /*Bitmap words per order, level 0 is the block bits*/
+    size_t words[MAX_K][INDEX_LEVELS];      /*Number of words on each level*/
+    unsigned char top[MAX_K];               /*Highest level of each order, it is a single word*/
+    size_t mapbytes;                        /*Size of the mapping holding this struct*/
+};
+
+/**
+ * @brief Mark block number i of order k free in the index.
+ */
+static inline void index_set(struct buddy_index *ix, size_t k, size_t i)
+{
+    for (size_t l = 0; l <= ix->top[k]; l++) {
+        uint64_t *word = &ix->level[k][l][i / 64];
+        bool was_empty = *word == 0;
+        *word |= UINT64_C(1) << (i % 64);
+        if (!was_empty) {
+            break;
+        }
+        i /= 64;
     }
+}
 
-    // Calculate the block size for the requested size, including metadata.
-    size_t needed_k = btok(size + sizeof(struct avail));
-    if (needed_k < SMALLEST_K) {
-        needed_k = SMALLEST_K; // Ensure the block size is at least the minimum.
+/**
+ * @brief Mark block number i of order k taken in the index.
+ */
+static inline void index_clear(struct buddy_index *ix, size_t k, size_t i)
+{
+    for (size_t l = 0; l <= ix->top[k]; l++) {
+        uint64_t *word = &ix->level[k][l][i / 64];
+        *word &= ~(UINT64_C(1) << (i % 64));
+        if (*word != 0) {
+            break;
+        }
+        i /= 64;
     }
-    if (needed_k > pool->kval_m) {
-        errno = ENOMEM; // Not enough memory in the pool.
-        return NULL;
+}
+
+/**
+ * @brief Walk down from a set bit at position i on level l to the block bit
+ * it summarizes, taking the lowest or highest branch at each level.
+ */
+static inline size_t index_descend(struct buddy_index *ix, size_t k, size_t l, size_t i, bool high)
+{
+    while (l-- > 0) {
+        uint64_t word = ix->level[k][l][i];
+        i = i * 64 + (size_t)(high ? 63 - __builtin_clzll(word) : __builtin_ctzll(word));
     }
+    return i;
+}
 
-    struct avail *block = NULL;
-    size_t k;
+/**
+ * @brief Find the lowest free block of order k whose number is at least from.
+ *
+ * @return size_t the block number or INDEX_NONE
+ */
+static size_t index_next(struct buddy_index *ix, size_t k, size_t from)
+{
+    for (size_t l = 0; l <= ix->top[k]; l++) {
+        size_t w = from / 64;
+        if (w >= ix->words[k][l]) {
+            return INDEX_NONE;
+        }
+        uint64_t word = ix->level[k][l][w] & (~UINT64_C(0) << (from % 64));
+        if (word) {
+            return index_descend(ix, k, l, w * 64 + (size_t)__builtin_ctzll(word), false);
+        }
+        from = w + 1;
+    }
+    return INDEX_NONE;
+}
 
-    // Find the first available block of the required size or larger.
-    for (k = needed_k; k <= pool->kval_m; k++) {
-        struct avail *sentinel = &pool->avail[k];
-        if (sentinel->next != sentinel) {
-            block = sentinel->next; // Take the first block from the free list.
-            block->prev->next = block->next;
-            block->next->prev = block->prev;
-            break;
+/**
+ * @brief Find the highest free block of order k whose number is at most from.
+ *
+ * @return size_t the block number or INDEX_NONE
+ */
+static size_t index_prev(struct buddy_index *ix, size_t k, size_t from)
+{
+    for (size_t l = 0; l <= ix->top[k]; l++) {
+        size_t w = from / 64;
+        if (w >= ix->words[k][l]) {
+            w = ix->words[k][l] - 1;
+            from = w * 64 + 63;
         }
+        uint64_t word = ix->level[k][l][w] & (~UINT64_C(0) >> (63 - from % 64));
+        if (word) {
+            return index_descend(ix, k, l, w * 64 + (size_t)(63 - __builtin_clzll(word)), true);
+        }
+        if (w == 0) {
+            return INDEX_NONE;
+        }
+        from = w - 1;
     }
-    if (!block) {
-        errno = ENOMEM; // No suitable block found.
-        return NULL;
+    return INDEX_NONE;
+}
+
+/**
+ * @brief Block number of a block within its order.
+ */
+static inline size_t index_of(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    return ((uintptr_t)block - (uintptr_t)pool->base) >> k;
+}
+
+/**
+ * @brief Block of order k with the given block number.
+ */
+static inline struct avail *block_at(struct buddy_pool *pool, size_t k, size_t i)
+{
+    return (struct avail *)((char *)pool->base + (i << k));
+}
+
+/**
+ * @brief Push a block on the front of the circular list headed by sentinel.
+ *
+ * @param pool The memory pool, counts the link operation
+ * @param sentinel The list head
+ * @param block The block to push
+ */
+static inline void list_push(struct buddy_pool *pool, struct avail *sentinel, struct avail *block)
+{
+    pool->stats.cost.links++;
+    block->next = sentinel->next;
+    block->prev = sentinel;
+    sentinel->next->prev = block;
+    sentinel->next = block;
+}
+
+/**
+ * @brief Unlink a block from whatever list it is on.
+ *
+ * @param pool The memory pool, counts the link operation
+ * @param block The block to unlink
+ */
+static inline void list_unlink(struct buddy_pool *pool, struct avail *block)
+{
+    pool->stats.cost.links++;
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+}
+
+/**
+ * @brief Push a free block on the front of the avail list for its kval.
+ *
+ * @param pool The memory pool
+ * @param block The block to push
+ */
+static inline void avail_push(struct buddy_pool *pool, struct avail *block)
+{
+    list_push(pool, &pool->avail[block->kval], block);
+    pool->stats.free_blocks[block->kval]++;
+    if (pool->index) {
+        index_set(pool->index, block->kval, index_of(pool, block, block->kval));
+    }
+}
+
+/**
+ * @brief Unlink a free block from its avail list.
+ *
+ * @param pool The memory pool
+ * @param block The block to unlink
+ */
+static inline void avail_unlink(struct buddy_pool *pool, struct avail *block)
+{
+    list_unlink(pool, block);
+    pool->stats.free_blocks[block->kval]--;
+    if (pool->index) {
+        index_clear(pool->index, block->kval, index_of(pool, block, block->kval));
+    }
+}
+
+/**
+ * @brief Build the address index of a pool from its avail lists.
+ *
+ * @param pool The memory pool
+ * @return 0 on success, -1 with errno set to ENOMEM on failure
+ */
+static int index_build(struct buddy_pool *pool)
+{
+    if (pool->index) {
+        return 0;
+    }
+
+    //Lay out every level of every order after the struct in one mapping
+    size_t total = 0;
+    size_t words[MAX_K][INDEX_LEVELS] = {{0}};
+    unsigned char top[MAX_K] = {0};
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        size_t bits = (size_t)1 << (pool->kval_m - k);
+        size_t l = 0;
+        do {
+            words[k][l] = (bits + 63) / 64;
+            total += words[k][l];
+            bits = words[k][l];
+        } while (words[k][l++] > 1);
+        top[k] = (unsigned char)(l - 1);
+    }
+    size_t mapbytes = sizeof(struct buddy_index) + total * sizeof(uint64_t);
+    struct buddy_index *ix = mmap(NULL, mapbytes, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == ix) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ix->mapbytes = mapbytes;
+    uint64_t *next = (uint64_t *)(ix + 1);
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        ix->top[k] = top[k];
+        for (size_t l = 0; l <= top[k]; l++) {
+            ix->level[k][l] = next;
+            ix->words[k][l] = words[k][l];
+            next += words[k][l];
+        }
+        for (struct avail *b = pool->avail[k].next; b != &pool->avail[k]; b = b->next) {
+            index_set(ix, k, index_of(pool, b, k));
+        }
+    }
+    pool->index = ix;
+    return 0;
+}
+
+int buddy_set_policy(struct buddy_pool *pool, int policy)
+{
+    if (!pool || policy < BUDDY_POLICY_LIFO || policy > BUDDY_POLICY_SEGREGATED) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (policy != BUDDY_POLICY_LIFO && index_build(pool) == -1) {
+        return -1;
+    }
+    pool->policy = policy;
+    return 0;
+}
+
+int buddy_set_segregated(struct buddy_pool *pool, size_t order)
+{
+    if (!pool || order > pool->kval_m) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (buddy_set_policy(pool, BUDDY_POLICY_SEGREGATED) == -1) {
+        return -1;
     }
+    pool->seg_k = order;
+    return 0;
+}
+
+/**
+ * Where block_place looks for a free block.
+ */
+enum place
+{
+    PLACE_LIFO,                 /*Most recently freed block of the smallest order that fits*/
+    PLACE_LOW,                  /*Lowest addressed block of the smallest order that fits*/
+    PLACE_BOTTOM,               /*Lowest addressed block of any order that fits*/
+    PLACE_TOP,                  /*Highest addressed block of any order that fits, split keeping the upper half*/
+};
 
+/**
+ * @brief Split an unlinked free block down to 2^needed_k bytes, putting the
+ * halves it does not keep back on the avail lists, and reserve it.
+ *
+ * @param pool The memory pool
+ * @param block The block, already off its avail list
+ * @param needed_k The kval of the block to keep
+ * @param upper Keep the upper half of every split instead of the lower one
+ * @return struct avail* the reserved block
+ */
+static struct avail *block_carve(struct buddy_pool *pool, struct avail *block, size_t needed_k, bool upper)
+{
     // Split the block into smaller blocks until it matches the required size.
     while (block->kval > needed_k) {
         block->kval--;
+        pool->stats.cost.splits++;
         size_t new_k = block->kval;
 
         // Calculate the buddy block's address.
         struct avail *buddy = (struct avail *)((char *)block + ((size_t)1 << new_k));
-        buddy->tag = BLOCK_AVAIL; // Mark the buddy as available.
         buddy->kval = new_k;
 
+        // Keep the upper half when asked to.
+        if (upper) {
+            struct avail *lower = block;
+            block = buddy;
+            buddy = lower;
+        }
+        buddy->tag = BLOCK_AVAIL; // Mark the buddy as available.
+
         // Add the buddy block to the free list for its size.
-        struct avail *sentinel = &pool->avail[new_k];
-        buddy->next = sentinel->next;
-        buddy->prev = sentinel;
-        sentinel->next->prev = buddy;
-        sentinel->next = buddy;
+        avail_push(pool, buddy);
     }
     block->tag = BLOCK_RESERVED; // Mark the block as reserved.
+    return block;
+}
 
-    // Return a pointer to the usable memory (after the metadata).
-    return (void *)((char *)block + sizeof(struct avail));
+/**
+ * @brief Find the free block an address placement would split from without
+ * taking it off its avail list.
+ *
+ * @param pool The memory pool, it must have an index
+ * @param needed_k The kval of the block
+ * @param place Where to look for the block, PLACE_LIFO always finds nothing
+ * @return struct avail* the free block or NULL
+ */
+static struct avail *place_find(struct buddy_pool *pool, size_t needed_k, enum place place)
+{
+    struct avail *block = NULL;
+
+    // Address ordered placement takes the lowest free block of the smallest order that fits.
+    if (place == PLACE_LOW) {
+        for (size_t k = needed_k; k <= pool->kval_m && !block; k++) {
+            size_t i = index_next(pool->index, k, 0);
+            if (i != INDEX_NONE) {
+                block = block_at(pool, k, i);
+            }
+        }
+    }
+
+    // The ends of the pool are found by looking at the extreme block of every order.
+    if (place == PLACE_BOTTOM || place == PLACE_TOP) {
+        for (size_t k = needed_k; k <= pool->kval_m; k++) {
+            size_t i = place == PLACE_BOTTOM ? index_next(pool->index, k, 0)
+                                             : index_prev(pool->index, k, INDEX_NONE);
+            if (i == INDEX_NONE) {
+                continue;
+            }
+            struct avail *candidate = block_at(pool, k, i);
+            if (!block || (place == PLACE_BOTTOM) == (candidate < block)) {
+                block = candidate;
+            }
+        }
+    }
+    return block;
 }
 
-void buddy_free(struct buddy_pool *pool, void *ptr)
+/**
+ * @brief Take a block of exactly 2^needed_k bytes off the avail lists,
+ * splitting larger blocks as needed.
+ *
+ * @param pool The memory pool
+ * @param needed_k The kval of the block
+ * @param place Where to look for the block, everything but PLACE_LIFO needs the index
+ * @return struct avail* the reserved block or NULL if no block is big enough
+ */
+static struct avail *block_place(struct buddy_pool *pool, size_t needed_k, enum place place)
 {
-    if (!pool || !ptr) {
-        return; // Do nothing if the pointer or pool is NULL.
+    struct avail *block = place_find(pool, needed_k, place);
+    if (block) {
+        avail_unlink(pool, block);
     }
 
-    // Recover the block header from the user pointer.
-    struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
+    // Find the first available block of the required size or larger.
+    for (size_t k = needed_k; k <= pool->kval_m && !block; k++) {
+        struct avail *sentinel = &pool->avail[k];
+        if (sentinel->next != sentinel) {
+            block = sentinel->next; // Take the first block from the free list.
+            avail_unlink(pool, block);
+        }
+    }
+    if (!block) {
+        return NULL;
+    }
+    return block_carve(pool, block, needed_k, place == PLACE_TOP);
+}
+
+/**
+ * @brief Find a free block of exactly 2^needed_k bytes as close to offset as
+ * possible. Walks up the subtrees that hold offset and searches the half of
+ * each one that offset is not in, so the first block found shares the
+ * smallest possible subtree with offset. Stops at subtrees of order
+ * BUDDY_NEAR_K.
+ *
+ * @param pool The memory pool, it must have an index
+ * @param needed_k The kval of the block
+ * @param offset The address to allocate near, relative to the pool base
+ * @return struct avail* the reserved block or NULL if nothing is free nearby
+ */
+static struct avail *block_near(struct buddy_pool *pool, size_t needed_k, size_t offset)
+{
+    size_t limit = needed_k > BUDDY_NEAR_K ? needed_k : BUDDY_NEAR_K;
+    if (limit > pool->kval_m) {
+        limit = pool->kval_m;
+    }
+    for (size_t j = needed_k + 1; j <= limit; j++) {
+        // The order j - 1 subtree next to the one holding offset
+        size_t sibling = (offset >> (j - 1)) ^ 1;
+        bool above = sibling & 1;
+        for (size_t k = needed_k; k < j; k++) {
+            size_t first = sibling << (j - 1 - k);
+            size_t last = first + ((size_t)1 << (j - 1 - k)) - 1;
+            size_t i = above ? index_next(pool->index, k, first) : index_prev(pool->index, k, last);
+            if (i != INDEX_NONE && i >= first && i <= last) {
+                struct avail *block = block_at(pool, k, i);
+                avail_unlink(pool, block);
+                // Keep the half of every split that faces offset
+                return block_carve(pool, block, needed_k, !above);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Where the placement policy of the pool wants a block of order
+ * needed_k.
+ */
+static inline enum place policy_place(struct buddy_pool *pool, size_t needed_k)
+{
+    switch (pool->policy) {
+    case BUDDY_POLICY_ADDRESS:
+        return PLACE_LOW;
+    case BUDDY_POLICY_SEGREGATED:
+        return needed_k < pool->seg_k ? PLACE_BOTTOM : PLACE_TOP;
+    default:
+        return PLACE_LIFO;
+    }
+}
+
+/**
+ * @brief Take a block of exactly 2^needed_k bytes off the avail lists where
+ * the placement policy of the pool wants it.
+ *
+ * @param pool The memory pool
+ * @param needed_k The kval of the block
+ * @return struct avail* the reserved block or NULL if no block is big enough
+ */
+static struct avail *block_split(struct buddy_pool *pool, size_t needed_k)
+{
+    return block_place(pool, needed_k, policy_place(pool, needed_k));
+}
+
+/**
+ * @brief Put a reserved block back on the avail lists, coalescing it with
+ * its buddies as far as possible.
+ *
+ * @param pool The memory pool
+ * @param block The block to merge, block->kval must be its order
+ */
+static void block_merge(struct buddy_pool *pool, struct avail *block)
+{
     block->tag = BLOCK_AVAIL; // Mark the block as available.
 
     // Try to coalesce with buddy blocks.
@@ -132,8 +540,7 @@ void buddy_free(struct buddy_pool *pool, void *ptr)
         }
 
         // Remove the buddy from the free list.
-        buddy->prev->next = buddy->next;
-        buddy->next->prev = buddy->prev;
+        avail_unlink(pool, buddy);
 
         // Merge the buddy with the current block.
         if (buddy < block) {
@@ -141,97 +548,2020 @@ void buddy_free(struct buddy_pool *pool, void *ptr)
         }
 
         block->kval++; // Move to the next larger block size.
+        pool->stats.cost.merges++;
+    }
+
+    // The top block of a child pool shares its header with the block the
+    // parent handed out, so it must keep looking reserved to the parent.
+    if (pool->parent && block->kval == pool->kval_m) {
+        block->tag = BLOCK_RESERVED;
     }
 
     // Add the coalesced block back to the free list.
-    struct avail *sentinel = &pool->avail[block->kval];
-    block->next = sentinel->next;
-    block->prev = sentinel;
-    sentinel->next->prev = block;
-    sentinel->next = block;
+    avail_push(pool, block);
 }
-  
 
 /**
- * @brief This is a simple version of realloc.
+ * @brief Take the pool lock if real-time mode shares the pool with the
+ * refill thread. Pass the result to pool_unlock so it undoes exactly what
+ * was done here even if real-time mode stops in between.
  *
- * @param poolThe memory pool
- * @param ptr  The user memory
- * @param size the new size requested
- * @return void* pointer to the new user memory
+ * @param pool The memory pool
+ * @return true if the lock was taken
  */
-void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+static inline bool pool_lock(struct buddy_pool *pool)
 {
-    if (!pool)
-        return NULL;
-    if (!ptr)
-        return buddy_malloc(pool, size);
-    if (size == 0) {
-        buddy_free(pool, ptr);
-        return NULL;
+    if (!__atomic_load_n(&pool->rt_running, __ATOMIC_ACQUIRE)) {
+        return false;
     }
+    pthread_mutex_lock(&pool->lock);
+    return true;
+}
 
-    // Recover the block header from the user pointer
-    struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
-    size_t allocated = ((size_t)1 << block->kval);
-    size_t old_payload = allocated - sizeof(struct avail);
-
-    // Calculate the min size that would require a smaller block
-    size_t min_req = 0;
-    if (block->kval > 0) {
-        min_req = ((size_t)1 << (block->kval - 1)) - sizeof(struct avail) + 1;
-    } else {
-        min_req = 0;
+/**
+ * @brief Release the lock taken by pool_lock.
+ *
+ * @param pool The memory pool
+ * @param locked The value pool_lock returned
+ */
+static inline void pool_unlock(struct buddy_pool *pool, bool locked)
+{
+    if (locked) {
+        pthread_mutex_unlock(&pool->lock);
     }
+}
 
-    if (size > min_req) {
-        void *new_ptr = buddy_malloc(pool, size);
-        if (!new_ptr) {
-            return NULL; // Allocation failed
+void buddy_coalesce(struct buddy_pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    bool locked = pool_lock(pool);
+    for (size_t k = 0; k <= pool->kval_m; k++) {
+        struct avail *sentinel = &pool->lazy[k];
+        while (sentinel->next != sentinel) {
+            struct avail *block = sentinel->next;
+            list_unlink(pool, block);
+            block_merge(pool, block);
         }
-
-        // Copy data from the old block to the new block
-        size_t copy_size = (old_payload < size) ? old_payload : size;
-        memcpy(new_ptr, ptr, copy_size);
-        buddy_free(pool, ptr);
-        return new_ptr;
-    } else {
-        // If the current block is suffcient return it
-        return ptr;
+        pool->lazy_count[k] = 0;
     }
+    pool_unlock(pool, locked);
 }
 
+void buddy_set_lazy(struct buddy_pool *pool, size_t threshold)
+{
+    if (!pool) {
+        return;
+    }
+    pool->lazy_limit = threshold;
+    if (threshold == 0) {
+        buddy_coalesce(pool);
+    }
+}
 
-void buddy_init(struct buddy_pool *pool, size_t size)
+void buddy_set_colors(struct buddy_pool *pool, size_t colors)
 {
-    size_t kval = 0;
-    if (size == 0)
-        kval = DEFAULT_K;
-    else
-        kval = btok(size);
+    if (!pool) {
+        return;
+    }
+    pool->colors = colors > 1 ? colors : 0;
+    pool->color_next = 0;
+}
 
-    if (kval < MIN_K)
+/**
+ * @brief Remember the size a user block was requested with. A reserved block
+ * is on no list, so its prev link is free to hold it.
+ */
+static inline void block_set_requested(struct avail *block, size_t size)
+{
+    block->prev = (struct avail *)(uintptr_t)size;
+}
+
+/**
+ * @brief The size a user block was requested with.
+ */
+static inline size_t block_requested(struct avail *block)
+{
+    return (size_t)(uintptr_t)block->prev;
+}
+
+/**
+ * @brief The user memory of a reserved block. With coloring on the user data
+ * of a large block starts the next color's number of lines into the block,
+ * with a BLOCK_COLORED header in front of it pointing back at the block.
+ *
+ * @param pool The memory pool
+ * @param block The reserved block
+ * @param size The user requested size
+ * @return void* the user memory
+ */
+static void *block_user(struct buddy_pool *pool, struct avail *block, size_t size)
+{
+    block_set_requested(block, size);
+    pool->stats.requested += size;
+    char *ptr = (char *)block + sizeof(struct avail);
+    if (!pool->colors || block->kval < BUDDY_COLOR_K) {
+        return ptr;
+    }
+    size_t slack = ((size_t)1 << block->kval) - sizeof(struct avail) - size;
+    size_t color = pool->color_next++ % pool->colors % (slack / BUDDY_COLOR_LINE + 1);
+    if (color == 0) {
+        return ptr;
+    }
+    ptr += color * BUDDY_COLOR_LINE;
+    struct avail *redirect = (struct avail *)(ptr - sizeof(struct avail));
+    redirect->tag = BLOCK_COLORED;
+    redirect->kval = block->kval;
+    redirect->next = block;
+    redirect->prev = NULL;
+    return ptr;
+}
+
+/**
+ * @brief Recover the block header from user memory, following the header
+ * of a colored block back to the block.
+ */
+static inline struct avail *block_of(void *ptr)
+{
+    struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
+    if (block->tag == BLOCK_COLORED) {
+        block = block->next;
+    }
+    return block;
+}
+
+/**
+ * @brief Start counting the cost of a public call. Must be called with the
+ * pool locked if it needs to be.
+ */
+static inline void cost_mark(struct buddy_pool *pool)
+{
+    pool->cost_mark = pool->stats.cost;
+}
+
+/**
+ * @brief Count a block handed out of the pool.
+ */
+static inline void stats_take(struct buddy_pool *pool, struct avail *block)
+{
+    struct buddy_stats *st = &pool->stats;
+    st->used_blocks[block->kval]++;
+    st->reserved += (size_t)1 << block->kval;
+    if (st->reserved > st->high_water) {
+        st->high_water = st->reserved;
+    }
+}
+
+/**
+ * @brief Count a block given back to the pool.
+ */
+static inline void stats_give(struct buddy_pool *pool, struct avail *block)
+{
+    pool->stats.used_blocks[block->kval]--;
+    pool->stats.reserved -= (size_t)1 << block->kval;
+}
+
+/**
+ * @brief Take a parked block of exactly 2^needed_k bytes off the lazy list
+ * if the placement policy would pick it. LIFO takes the most recently parked
+ * block. The address policies take the parked block nearest their end of the
+ * pool, and only when no free block of the same order is placed better, so
+ * lazy coalescing does not undo the placement.
+ *
+ * @param pool The memory pool
+ * @param needed_k The kval of the block
+ * @return struct avail* the block, still tagged reserved, or NULL
+ */
+static struct avail *lazy_take(struct buddy_pool *pool, size_t needed_k)
+{
+    struct avail *sentinel = &pool->lazy[needed_k];
+    if (sentinel->next == sentinel) {
+        return NULL;
+    }
+    struct avail *block = sentinel->next;
+    enum place place = policy_place(pool, needed_k);
+    if (place != PLACE_LIFO) {
+        bool low = place != PLACE_TOP;
+        for (struct avail *b = block->next; b != sentinel; b = b->next) {
+            if (low == (b < block)) {
+                block = b;
+            }
+        }
+        // PLACE_LOW prefers the smallest order so only a free block of this
+        // order can beat a parked one
+        struct avail *candidate = place_find(pool, needed_k, place);
+        if (candidate && (place != PLACE_LOW || candidate->kval == needed_k)
+            && low == (candidate < block)) {
+            return NULL;
+        }
+    }
+    list_unlink(pool, block);
+    pool->lazy_count[needed_k]--;
+    return block;
+}
+
+/**
+ * @brief Take a block of exactly 2^needed_k bytes out of the pool. A lazily
+ * freed block of the same order is reused as is, otherwise larger blocks are
+ * split as needed. The whole block including the header space is handed to
+ * the caller and tagged as reserved.
+ *
+ * @param pool The memory pool
+ * @param needed_k The kval of the block
+ * @return struct avail* the block or NULL with errno set to ENOMEM
+ */
+static struct avail *block_take(struct buddy_pool *pool, size_t needed_k)
+{
+    if (needed_k > pool->kval_m) {
+        pool->stats.failures++;
+        errno = ENOMEM; // Not enough memory in the pool.
+        return NULL;
+    }
+
+    struct avail *block = lazy_take(pool, needed_k);
+    if (block) {
+        stats_take(pool, block);
+        return block;
+    }
+
+    block = block_split(pool, needed_k);
+    if (!block) {
+        // Lazily freed blocks may merge into something big enough
+        buddy_coalesce(pool);
+        block = block_split(pool, needed_k);
+    }
+    if (!block) {
+        pool->stats.failures++;
+        errno = ENOMEM; // No suitable block found.
+        return NULL;
+    }
+    stats_take(pool, block);
+    return block;
+}
+
+/**
+ * @brief Give a reserved block back to the pool. With lazy coalescing on the
+ * block is parked at its order until the order holds more than the lazy
+ * limit, then the whole order is coalesced. In real-time mode the block is
+ * always parked.
+ *
+ * @param pool The memory pool
+ * @param block The block to release, block->kval must be its order
+ */
+static void block_release(struct buddy_pool *pool, struct avail *block)
+{
+    size_t k = block->kval;
+    stats_give(pool, block);
+    // In real-time mode the refill thread does all the coalescing
+    size_t limit = __atomic_load_n(&pool->rt_running, __ATOMIC_RELAXED)
+        ? SIZE_MAX : pool->lazy_limit;
+    if (limit) {
+        if (pool->lazy_count[k] < limit) {
+            // Stays tagged reserved so no buddy merges with it
+            block->tag = BLOCK_RESERVED;
+            list_push(pool, &pool->lazy[k], block);
+            pool->lazy_count[k]++;
+            return;
+        }
+        struct avail *sentinel = &pool->lazy[k];
+        while (sentinel->next != sentinel) {
+            struct avail *lazy = sentinel->next;
+            list_unlink(pool, lazy);
+            block_merge(pool, lazy);
+        }
+        pool->lazy_count[k] = 0;
+    }
+    block_merge(pool, block);
+}
+
+/**
+ * @brief One pass of the refill thread over every order. Each order moves
+ * at most one block toward its reserve and the lock is dropped between
+ * orders so callers never wait behind more than one split or merge chain.
+ * Must be called with the pool lock held.
+ *
+ * @param pool The memory pool
+ * @return true if any block was moved
+ */
+static bool rt_refill(struct buddy_pool *pool)
+{
+    bool busy = false;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m && !pool->rt_stop; k++) {
+        size_t target = pool->rt_reserve[k];
+        struct avail *sentinel = &pool->lazy[k];
+        if (pool->lazy_count[k] > 2 * target) {
+            struct avail *block = sentinel->next;
+            list_unlink(pool, block);
+            pool->lazy_count[k]--;
+            block_merge(pool, block);
+        } else if (pool->lazy_count[k] < target) {
+            struct avail *block = block_split(pool, k);
+            if (!block) {
+                continue;
+            }
+            list_push(pool, sentinel, block);
+            pool->lazy_count[k]++;
+        } else {
+            continue;
+        }
+        busy = true;
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_lock(&pool->lock);
+    }
+    return busy;
+}
+
+/**
+ * @brief Body of the real-time refill thread.
+ *
+ * @param arg The memory pool
+ * @return void* always NULL
+ */
+static void *rt_worker(void *arg)
+{
+    struct buddy_pool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->rt_stop) {
+        if (!rt_refill(pool) && !pool->rt_stop) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += (long)pool->rt_interval_us * 1000;
+            ts.tv_sec += ts.tv_nsec / 1000000000;
+            ts.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&pool->rt_wake, &pool->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void buddy_rt_reserve(struct buddy_pool *pool, size_t order, size_t count)
+{
+    if (!pool || order < SMALLEST_K || order > pool->kval_m) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->rt_reserve[order] = count;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int buddy_rt_start(struct buddy_pool *pool, unsigned int interval_us)
+{
+    if (!pool) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (__atomic_load_n(&pool->rt_running, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    pool->rt_interval_us = interval_us;
+    pool->rt_stop = false;
+    __atomic_store_n(&pool->rt_running, true, __ATOMIC_RELEASE);
+    int rval = pthread_create(&pool->rt_thread, NULL, rt_worker, pool);
+    if (rval) {
+        __atomic_store_n(&pool->rt_running, false, __ATOMIC_RELEASE);
+        errno = rval;
+        return -1;
+    }
+    return 0;
+}
+
+void buddy_rt_stop(struct buddy_pool *pool)
+{
+    if (!pool || !__atomic_load_n(&pool->rt_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->rt_stop = true;
+    pthread_cond_signal(&pool->rt_wake);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->rt_thread, NULL);
+    // Cleared under the lock so a caller that saw it set is done first
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->rt_running, false, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->lock);
+    buddy_coalesce(pool);
+}
+
+/**
+ * The number of bitmap words in a slab header. Enough for 16 byte objects,
+ * the smallest size of any class fixed or learned, which have the most
+ * objects per slab.
+ */
+#define SLAB_WORDS 4
+
+/**
+ * @brief Header at the front of every slab. The slab is a block of order
+ * BUDDY_SLAB_K taken whole from the pool, the objects follow the header.
+ */
+struct slab
+{
+    struct avail hdr;           /*Block header, next/prev link the slab on its class partial list*/
+    unsigned short cls;         /*Index of the size class*/
+    unsigned short inuse;       /*Number of objects handed out*/
+    unsigned int size;          /*Object size in bytes*/
+    uint64_t free[SLAB_WORDS];  /*A set bit marks a free object*/
+};
+
+/**
+ * @brief A slab size class.
+ */
+struct slab_class
+{
+    struct avail partial;       /*Sentinel of the slabs that have free objects*/
+    size_t size;                /*Object size in bytes*/
+    size_t nobj;                /*Objects per slab*/
+    size_t replaces;            /*Learned classes: object size the request would have had without it*/
+    size_t allocs;              /*Objects handed out over the life of the class*/
+    size_t live;                /*Objects currently handed out*/
+};
+
+/**
+ * The fixed size classes. Classes are multiples of 16 so every object is
+ * 16 byte aligned. Learned classes are multiples of 8.
+ */
+static const size_t slab_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024,
+};
+
+#define SLAB_CLASSES (sizeof(slab_sizes) / sizeof(slab_sizes[0]))
+
+/**
+ * The number of 8 byte granules the front end routes.
+ */
+#define SLAB_GRANULES (BUDDY_SLAB_MAX / 8 + 1)
+
+/**
+ * A size must be at least this many parts per thousand of the profiling
+ * window before it earns a learned class.
+ */
+#define SLAB_HOT_PERMILLE 10
+
+/**
+ * @brief Per pool state of the small object front end. The page map that
+ * marks which BUDDY_SLAB_K sized pages are slabs follows this struct in the
+ * same mapping.
+ */
+struct buddy_slabs
+{
+    struct slab_class cls[SLAB_CLASSES + BUDDY_SLAB_LEARNED]; /*Fixed classes then learned classes*/
+    size_t learned;                         /*Number of learned classes in use*/
+    signed char route[SLAB_GRANULES];       /*Class for each 8 byte granule, -1 to use buddy blocks*/
+    size_t window;                          /*Samples left in the profiling window, 0 when not profiling*/
+    size_t top_k;                           /*Classes to learn when the window closes*/
+    size_t samples;                         /*Requests sampled over all windows*/
+    size_t hist[SLAB_GRANULES];             /*Requests seen per granule in the current window*/
+    size_t mapbytes;                        /*Size of the mapping holding this struct*/
+    uint64_t *pagemap;                      /*One bit per page of the pool, set for slabs*/
+};
+
+/**
+ * @brief Number of objects of size bytes that fit in one slab.
+ *
+ * @param size The object size
+ * @return size_t objects per slab
+ */
+static inline size_t slab_nobj(size_t size)
+{
+    return ((UINT64_C(1) << BUDDY_SLAB_K) - sizeof(struct slab)) / size;
+}
+
+/**
+ * @brief Memory one object of size bytes costs in a slab, counting its share
+ * of the slab header and the tail of the slab that no object fits in.
+ *
+ * @param size The object size
+ * @return size_t bytes per object
+ */
+static inline size_t slab_cost(size_t size)
+{
+    return (UINT64_C(1) << BUDDY_SLAB_K) / slab_nobj(size);
+}
+
+/**
+ * @brief Memory a request of size bytes costs in the front end as currently
+ * routed.
+ *
+ * @param slabs The front end
+ * @param g The 8 byte granule of the request
+ * @return size_t bytes per object
+ */
+static size_t route_cost(struct buddy_slabs *slabs, size_t g)
+{
+    if (slabs->route[g] >= 0) {
+        return slab_cost(slabs->cls[(size_t)slabs->route[g]].size);
+    }
+    size_t k = btok(g * 8 + sizeof(struct avail));
+    return UINT64_C(1) << (k < SMALLEST_K ? SMALLEST_K : k);
+}
+
+/**
+ * @brief Set up size class cls for objects of size bytes.
+ *
+ * @param slabs The front end
+ * @param cls The class index
+ * @param size The object size
+ */
+static void slab_class_init(struct buddy_slabs *slabs, size_t cls, size_t size)
+{
+    struct slab_class *sc = &slabs->cls[cls];
+    sc->partial.next = sc->partial.prev = &sc->partial;
+    sc->partial.tag = BLOCK_UNUSED;
+    sc->partial.kval = BUDDY_SLAB_K;
+    sc->size = size;
+    sc->nobj = slab_nobj(size);
+    assert(sc->nobj <= SLAB_WORDS * 64);
+}
+
+/**
+ * @brief Close the profiling window. The hottest sampled sizes that would
+ * waste less in a class of their own get one. Existing objects stay in the
+ * slabs they were allocated from and drain out as they are freed.
+ *
+ * @param slabs The front end
+ */
+static void slab_learn(struct buddy_slabs *slabs)
+{
+    size_t total = 0;
+    for (size_t g = 1; g < SLAB_GRANULES; g++) {
+        total += slabs->hist[g];
+    }
+
+    while (slabs->top_k > 0 && slabs->learned < BUDDY_SLAB_LEARNED) {
+        //Pick the hottest granule that would get cheaper with a class of its own.
+        //8 byte objects would overflow the slab bitmap, they stay in the 16 byte class.
+        size_t best = 0;
+        for (size_t g = 2; g < SLAB_GRANULES; g++) {
+            if (slabs->hist[g] > slabs->hist[best] && slab_cost(g * 8) < route_cost(slabs, g)) {
+                best = g;
+            }
+        }
+        if (!best || slabs->hist[best] * 1000 < total * SLAB_HOT_PERMILLE) {
+            break;
+        }
+
+        size_t cls = SLAB_CLASSES + slabs->learned++;
+        slab_class_init(slabs, cls, best * 8);
+        //Remember what the hot size was getting before so we can report the savings
+        if (slabs->route[best] >= 0) {
+            slabs->cls[cls].replaces = slabs->cls[(size_t)slabs->route[best]].size;
+        } else {
+            slabs->cls[cls].replaces = route_cost(slabs, best) - sizeof(struct avail);
+        }
+        slabs->route[best] = (signed char)cls;
+        slabs->hist[best] = 0;
+        slabs->top_k--;
+    }
+    memset(slabs->hist, 0, sizeof(slabs->hist));
+    slabs->top_k = 0;
+}
+
+_Static_assert(sizeof(struct slab) % 16 == 0, "slab objects must stay 16 byte aligned");
+
+int buddy_slab_enable(struct buddy_pool *pool)
+{
+    if (!pool) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pool->slabs) {
+        return 0;
+    }
+
+    size_t pages = pool->numbytes >> BUDDY_SLAB_K;
+    size_t mapbytes = sizeof(struct buddy_slabs) + ((pages + 63) / 64) * sizeof(uint64_t);
+    struct buddy_slabs *slabs = mmap(NULL, mapbytes, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == slabs) {
+        errno = ENOMEM;
+        return -1;
+    }
+    slabs->mapbytes = mapbytes;
+    slabs->pagemap = (uint64_t *)(slabs + 1);
+
+    for (size_t c = 0; c < SLAB_CLASSES; c++) {
+        slab_class_init(slabs, c, slab_sizes[c]);
+    }
+
+    //Only send a granule to a slab when a slab object, counting its share of
+    //the slab header and tail waste, is cheaper than the buddy block
+    size_t c = 0;
+    slabs->route[0] = -1;
+    for (size_t g = 1; g < SLAB_GRANULES; g++) {
+        while (slab_sizes[c] < g * 8) {
+            c++;
+        }
+        slabs->route[g] = -1;
+        if (slab_cost(slab_sizes[c]) < route_cost(slabs, g)) {
+            slabs->route[g] = (signed char)c;
+        }
+    }
+
+    pool->slabs = slabs;
+    return 0;
+}
+
+int buddy_slab_profile(struct buddy_pool *pool, size_t window, size_t top_k)
+{
+    if (!pool || window == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (buddy_slab_enable(pool) == -1) {
+        return -1;
+    }
+    struct buddy_slabs *slabs = pool->slabs;
+    memset(slabs->hist, 0, sizeof(slabs->hist));
+    slabs->top_k = top_k;
+    slabs->window = window;
+    return 0;
+}
+
+void buddy_slab_report(struct buddy_pool *pool, struct buddy_slab_report *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (!pool || !pool->slabs) {
+        return;
+    }
+    struct buddy_slabs *slabs = pool->slabs;
+    out->samples = slabs->samples;
+    out->profiling = slabs->window != 0;
+    out->learned = slabs->learned;
+    for (size_t i = 0; i < slabs->learned; i++) {
+        struct slab_class *sc = &slabs->cls[SLAB_CLASSES + i];
+        out->size[i] = sc->size;
+        out->replaces[i] = sc->replaces;
+        out->allocs[i] = sc->allocs;
+        out->live[i] = sc->live;
+        out->saved_bytes += sc->allocs * (sc->replaces - sc->size);
+        out->live_saved_bytes += sc->live * (sc->replaces - sc->size);
+    }
+}
+
+/**
+ * @brief Find the slab holding ptr.
+ *
+ * @param pool The memory pool
+ * @param ptr A pointer handed out by the pool
+ * @return struct slab* the slab or NULL if ptr is a buddy block
+ */
+static inline struct slab *slab_of(struct buddy_pool *pool, void *ptr)
+{
+    if (!pool->slabs) {
+        return NULL;
+    }
+    size_t page = ((uintptr_t)ptr - (uintptr_t)pool->base) >> BUDDY_SLAB_K;
+    if (!(pool->slabs->pagemap[page / 64] & (UINT64_C(1) << (page % 64)))) {
+        return NULL;
+    }
+    return (struct slab *)((char *)pool->base + (page << BUDDY_SLAB_K));
+}
+
+/**
+ * @brief Flip the page map bit of a slab.
+ *
+ * @param pool The memory pool
+ * @param s The slab
+ */
+static inline void slab_mark(struct buddy_pool *pool, struct slab *s)
+{
+    size_t page = ((uintptr_t)s - (uintptr_t)pool->base) >> BUDDY_SLAB_K;
+    pool->slabs->pagemap[page / 64] ^= UINT64_C(1) << (page % 64);
+}
+
+/**
+ * @brief Allocate one object of size class cls, taking a new slab from the
+ * pool when every slab of the class is full.
+ *
+ * @param pool The memory pool
+ * @param cls The size class
+ * @return void* the object or NULL with errno set to ENOMEM
+ */
+static void *slab_alloc(struct buddy_pool *pool, size_t cls)
+{
+    struct slab_class *sc = &pool->slabs->cls[cls];
+    struct slab *s = (struct slab *)sc->partial.next;
+
+    if (&s->hdr == &sc->partial) {
+        struct avail *block = block_take(pool, BUDDY_SLAB_K);
+        if (!block) {
+            return NULL;
+        }
+        s = (struct slab *)block;
+        s->cls = (unsigned short)cls;
+        s->inuse = 0;
+        s->size = (unsigned int)sc->size;
+        for (size_t w = 0; w < SLAB_WORDS; w++) {
+            size_t bits = sc->nobj > w * 64 ? sc->nobj - w * 64 : 0;
+            s->free[w] = bits >= 64 ? ~UINT64_C(0) : (UINT64_C(1) << bits) - 1;
+        }
+        slab_mark(pool, s);
+        list_push(pool, &sc->partial, &s->hdr);
+    }
+
+    size_t w = 0;
+    while (!s->free[w]) {
+        w++;
+    }
+    size_t idx = w * 64 + (size_t)__builtin_ctzll(s->free[w]);
+    s->free[w] &= s->free[w] - 1;
+
+    sc->allocs++;
+    sc->live++;
+
+    //Full slabs leave the partial list until an object comes back
+    if (++s->inuse == sc->nobj) {
+        list_unlink(pool, &s->hdr);
+    }
+    return (char *)(s + 1) + idx * s->size;
+}
+
+/**
+ * @brief Give an object back to its slab, returning the slab to the pool
+ * once it is empty.
+ *
+ * @param pool The memory pool
+ * @param s The slab holding ptr
+ * @param ptr The object
+ */
+static void slab_free(struct buddy_pool *pool, struct slab *s, void *ptr)
+{
+    struct slab_class *sc = &pool->slabs->cls[s->cls];
+    size_t idx = (size_t)((char *)ptr - (char *)(s + 1)) / s->size;
+    s->free[idx / 64] |= UINT64_C(1) << (idx % 64);
+    sc->live--;
+
+    if (s->inuse-- == sc->nobj) {
+        list_push(pool, &sc->partial, &s->hdr);
+    }
+    if (s->inuse == 0) {
+        list_unlink(pool, &s->hdr);
+        slab_mark(pool, s);
+        block_release(pool, &s->hdr);
+    }
+}
+
+/**
+ * @brief Calculate the block size for a requested size, including metadata.
+ *
+ * @param size The user requested size
+ * @return size_t the kval of the block, MAX_K if it can never fit
+ */
+static inline size_t request_kval(size_t size)
+{
+    if (size > SIZE_MAX / 2) {
+        return MAX_K;
+    }
+    // Same as btok, without its loop mispredicting on mixed sizes
+    size_t needed_k = 64 - (size_t)__builtin_clzll(size + sizeof(struct avail) - 1);
+    if (needed_k < SMALLEST_K) {
+        needed_k = SMALLEST_K; // Ensure the block size is at least the minimum.
+    }
+    return needed_k;
+}
+
+/**
+ * @brief Allocate a buddy block for size bytes at a given place in the pool,
+ * bypassing the slab layer and the lazy lists. The pool is locked by the
+ * caller if it needs to be.
+ *
+ * @param pool The memory pool
+ * @param size The user requested size
+ * @param place Where in the pool to take the block from
+ * @return void* the user memory or NULL with errno set
+ */
+static void *pool_malloc_placed(struct buddy_pool *pool, size_t size, enum place place)
+{
+    size_t needed_k = request_kval(size);
+    if (needed_k > pool->kval_m) {
+        pool->stats.failures++;
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (index_build(pool) == -1) {
+        return NULL;
+    }
+    struct avail *block = block_place(pool, needed_k, place);
+    if (!block) {
+        // Lazily freed blocks may merge into something big enough
+        buddy_coalesce(pool);
+        block = block_place(pool, needed_k, place);
+    }
+    if (!block) {
+        pool->stats.failures++;
+        errno = ENOMEM;
+        return NULL;
+    }
+    stats_take(pool, block);
+    return block_user(pool, block, size);
+}
+
+/**
+ * @brief buddy_malloc once the arguments have been checked and the pool is
+ * locked if it needs to be.
+ */
+static void *pool_malloc(struct buddy_pool *pool, size_t size)
+{
+    // Small requests go to the slab layer when it is cheaper than a block.
+    if (pool->slabs && size <= BUDDY_SLAB_MAX) {
+        struct buddy_slabs *slabs = pool->slabs;
+        size_t g = (size + 7) / 8;
+        if (slabs->window) {
+            slabs->hist[g]++;
+            slabs->samples++;
+            if (--slabs->window == 0) {
+                slab_learn(slabs);
+            }
+        }
+        int cls = slabs->route[g];
+        if (cls >= 0) {
+            void *obj = slab_alloc(pool, (size_t)cls);
+            if (obj) {
+                pool->stats.requested += slabs->cls[cls].size;
+            }
+            return obj;
+        }
+    }
+
+    struct avail *block = block_take(pool, request_kval(size));
+    if (!block) {
+        return NULL;
+    }
+
+    // Return a pointer to the usable memory (after the metadata).
+    return block_user(pool, block, size);
+}
+
+/**
+ * @brief buddy_malloc_near once the arguments have been checked and the pool
+ * is locked if it needs to be.
+ */
+static void *pool_malloc_near(struct buddy_pool *pool, size_t size, size_t offset)
+{
+    size_t needed_k = request_kval(size);
+    if (needed_k <= pool->kval_m && index_build(pool) == 0) {
+        struct avail *block = block_near(pool, needed_k, offset);
+        if (block) {
+            stats_take(pool, block);
+            return block_user(pool, block, size);
+        }
+    }
+    // Nothing free nearby, allocate from wherever
+    return pool_malloc(pool, size);
+}
+
+/**
+ * @brief The largest order from min_k to max_k that can be taken without
+ * failing, where anything larger counts as max_k.
+ *
+ * @return size_t the order or 0 if nothing of order min_k or more is free
+ */
+static size_t range_kval(struct buddy_pool *pool, size_t min_k, size_t max_k)
+{
+    for (size_t k = pool->kval_m; k >= min_k; k--) {
+        if (pool->avail[k].next != &pool->avail[k] || pool->lazy[k].next != &pool->lazy[k]) {
+            return k < max_k ? k : max_k;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief buddy_malloc_range once the arguments have been checked and the
+ * pool is locked if it needs to be.
+ */
+static void *pool_malloc_range(struct buddy_pool *pool, size_t min, size_t max, size_t *got)
+{
+    size_t min_k = request_kval(min);
+    if (min_k > pool->kval_m) {
+        pool->stats.failures++;
+        errno = ENOMEM;
+        return NULL;
+    }
+    // The largest block whose usable size stays within max, but never less than min
+    size_t max_k = min_k;
+    while (max_k < pool->kval_m && ((size_t)1 << (max_k + 1)) - sizeof(struct avail) <= max) {
+        max_k++;
+    }
+
+    size_t k = range_kval(pool, min_k, max_k);
+    if (k == 0) {
+        // Lazily freed blocks may merge into something big enough
+        buddy_coalesce(pool);
+        k = range_kval(pool, min_k, max_k);
+    }
+    if (k == 0) {
+        pool->stats.failures++;
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct avail *block = block_take(pool, k);
+    if (!block) {
+        return NULL;
+    }
+    size_t usable = ((size_t)1 << k) - sizeof(struct avail);
+    if (got) {
+        *got = usable;
+    }
+    return block_user(pool, block, usable);
+}
+
+/**
+ * @brief buddy_usable_size once the arguments have been checked and the pool
+ * is locked if it needs to be.
+ */
+static size_t pool_usable_size(struct buddy_pool *pool, void *ptr)
+{
+    struct slab *s = slab_of(pool, ptr);
+    if (s) {
+        return s->size;
+    }
+    struct avail *block = block_of(ptr);
+    return ((size_t)1 << block->kval) - (size_t)((char *)ptr - (char *)block);
+}
+
+/**
+ * @brief buddy_malloc_usable once the arguments have been checked and the
+ * pool is locked if it needs to be.
+ */
+static void *pool_malloc_usable(struct buddy_pool *pool, size_t size, size_t *usable)
+{
+    void *ptr = pool_malloc(pool, size);
+    if (ptr && usable) {
+        *usable = pool_usable_size(pool, ptr);
+    }
+    return ptr;
+}
+
+/**
+ * @brief buddy_free once the arguments have been checked and the pool is
+ * locked if it needs to be.
+ */
+static void pool_free(struct buddy_pool *pool, void *ptr)
+{
+    struct slab *s = slab_of(pool, ptr);
+    if (s) {
+        pool->stats.requested -= s->size;
+        slab_free(pool, s, ptr);
+        return;
+    }
+
+    // Recover the block header from the user pointer.
+    struct avail *block = block_of(ptr);
+    pool->stats.requested -= block_requested(block);
+    block_release(pool, block);
+}
+  
+
+/**
+ * @brief buddy_free_sized once the arguments have been checked and the pool
+ * is locked if it needs to be.
+ */
+static void pool_free_sized(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    // Slab objects are found through the page map, not their size
+    if (pool->slabs && size <= BUDDY_SLAB_MAX) {
+        pool_free(pool, ptr);
+        return;
+    }
+
+    // The block starts at ptr rounded down to its order, colored or not
+    size_t k = request_kval(size);
+    size_t offset = ((uintptr_t)ptr - (uintptr_t)pool->base) & ~(((size_t)1 << k) - 1);
+    struct avail *block = (struct avail *)((char *)pool->base + offset);
+
+    // Only debug builds read the header to check the caller
+    assert(block->tag == BLOCK_RESERVED && block->kval == k);
+
+    // The stats give back the size passed in, not the one kept in the header
+    block->kval = k;
+    pool->stats.requested -= size < pool->stats.requested ? size : pool->stats.requested;
+    block_release(pool, block);
+}
+
+/**
+ * @brief This is a simple version of realloc. The arguments have been
+ * checked and the pool is locked if it needs to be.
+ *
+ * @param poolThe memory pool
+ * @param ptr  The user memory
+ * @param size the new size requested
+ * @return void* pointer to the new user memory
+ */
+static void *pool_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    // Slab objects stay put while the new size still fits their class
+    struct slab *s = slab_of(pool, ptr);
+    if (s) {
+        if (size <= s->size) {
+            return ptr;
+        }
+        void *new_ptr = pool_malloc(pool, size);
+        if (!new_ptr) {
+            return NULL;
+        }
+        memcpy(new_ptr, ptr, s->size);
+        pool->stats.cost.copied += s->size;
+        pool_free(pool, ptr);
+        return new_ptr;
+    }
+
+    // Recover the block header from the user pointer
+    struct avail *block = block_of(ptr);
+    size_t allocated = ((size_t)1 << block->kval);
+    size_t old_payload = allocated - (size_t)((char *)ptr - (char *)block);
+
+    // Calculate the min size that would require a smaller block
+    size_t min_req = 0;
+    if (block->kval > 0) {
+        min_req = ((size_t)1 << (block->kval - 1)) - sizeof(struct avail) + 1;
+    } else {
+        min_req = 0;
+    }
+
+    if (size > min_req) {
+        void *new_ptr = pool_malloc(pool, size);
+        if (!new_ptr) {
+            return NULL; // Allocation failed
+        }
+
+        // Copy data from the old block to the new block
+        size_t copy_size = (old_payload < size) ? old_payload : size;
+        memcpy(new_ptr, ptr, copy_size);
+        pool->stats.cost.copied += copy_size;
+        pool_free(pool, ptr);
+        return new_ptr;
+    } else {
+        // If the current block is suffcient return it
+        pool->stats.requested += size - block_requested(block);
+        block_set_requested(block, size);
+        return ptr;
+    }
+}
+
+/**
+ * @brief Latency histogram bucket of a tick count. Counts below twice
+ * BUDDY_HIST_SUB have a bucket each, above that every power of two is split
+ * into BUDDY_HIST_SUB equal buckets.
+ */
+static inline size_t hist_bucket(uint64_t ticks)
+{
+    if (ticks < 2 * BUDDY_HIST_SUB) {
+        return (size_t)ticks;
+    }
+    size_t e = 63 - (size_t)__builtin_clzll(ticks);
+    size_t sub = (size_t)(ticks >> (e - 3)) & (BUDDY_HIST_SUB - 1);
+    return 2 * BUDDY_HIST_SUB + (e - 4) * BUDDY_HIST_SUB + sub;
+}
+
+uint64_t buddy_hist_floor(size_t bucket)
+{
+    if (bucket < 2 * BUDDY_HIST_SUB) {
+        return bucket;
+    }
+    size_t e = (bucket - 2 * BUDDY_HIST_SUB) / BUDDY_HIST_SUB + 4;
+    uint64_t sub = (bucket - 2 * BUDDY_HIST_SUB) % BUDDY_HIST_SUB;
+    return (BUDDY_HIST_SUB + sub) << (e - 3);
+}
+
+/**
+ * @brief Ticks of the clock used for latency and traces, the TSC where
+ * there is one and nanoseconds elsewhere.
+ */
+static inline uint64_t ticks_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#ifdef BUDDY_HISTOGRAMS
+/**
+ * @brief Count one call of op for size that started at start. Several
+ * threads may record into the same pool at once.
+ */
+static void hist_record(struct buddy_pool *pool, int op, size_t size, uint64_t start)
+{
+    uint64_t ticks = ticks_now() - start;
+    if (!pool->hist) {
+        return;
+    }
+    size_t k = request_kval(size);
+    if (k >= MAX_K) {
+        k = MAX_K - 1;
+    }
+    __atomic_fetch_add(&pool->hist->count[op][k][hist_bucket(ticks)], 1, __ATOMIC_RELAXED);
+}
+
+#define HIST_START() uint64_t hist_start = ticks_now()
+#define HIST_START_FREE(pool, ptr)                                      \
+    size_t hist_size = (pool)->hist ? buddy_usable_size((pool), (ptr)) : 0; \
+    HIST_START()
+#define HIST_RECORD(pool, op, size) hist_record((pool), (op), (size), hist_start)
+#else
+#define HIST_START()
+#define HIST_START_FREE(pool, ptr)
+#define HIST_RECORD(pool, op, size)
+#endif
+
+_Static_assert(sizeof(struct buddy_trace_header) == 64, "trace header layout is part of the file format");
+_Static_assert(sizeof(struct buddy_trace_record) == 40, "trace record layout is part of the file format");
+
+/**
+ * Kernel thread id of the calling thread, looked up on its first trace.
+ */
+static __thread uint32_t trace_tid;
+
+/**
+ * @brief Reserve the next record in the trace ring. The record that lands
+ * on slot 0 again counts the wrap, so only one call per lap pays for it.
+ *
+ * @return struct buddy_trace_record* the slot of the record
+ */
+static inline struct buddy_trace_record *trace_reserve(struct buddy_trace_header *tr)
+{
+    if (!trace_tid) {
+#ifdef __linux__
+        trace_tid = (uint32_t)syscall(SYS_gettid);
+#else
+        trace_tid = (uint32_t)(uintptr_t)pthread_self();
+#endif
+    }
+    uint64_t n = __atomic_fetch_add(&tr->head, 1, __ATOMIC_RELAXED);
+    uint64_t slot = n % tr->capacity;
+    if (slot == 0 && n) {
+        __atomic_fetch_add(&tr->wraps, 1, __ATOMIC_RELAXED);
+    }
+    return (struct buddy_trace_record *)(tr + 1) + slot;
+}
+
+/**
+ * @brief The offset of ptr in the trace of the pool.
+ */
+static inline uint64_t trace_offset(struct buddy_pool *pool, void *ptr)
+{
+    return ptr ? (uint64_t)((uintptr_t)ptr - (uintptr_t)pool->base) : BUDDY_TRACE_NULL;
+}
+
+/**
+ * @brief Append a call to the trace of the pool. old_ptr is the pointer
+ * passed to realloc and NULL for every other op.
+ */
+static void trace_record(struct buddy_pool *pool, int op, size_t size, void *ptr, void *old_ptr)
+{
+    struct buddy_trace_record *rec = trace_reserve(pool->trace);
+    rec->tsc = ticks_now();
+    rec->size = size;
+    rec->offset = trace_offset(pool, ptr);
+    rec->old_offset = trace_offset(pool, old_ptr);
+    rec->tid = trace_tid;
+    rec->op = (uint16_t)op;
+    rec->flags = 0;
+}
+
+int buddy_trace_start(struct buddy_pool *pool, const char *path, size_t records)
+{
+    if (!pool || !path || records == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    buddy_trace_stop(pool);
+
+    size_t bytes = sizeof(struct buddy_trace_header) + records * sizeof(struct buddy_trace_record);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)bytes) == -1) {
+        close(fd);
+        return -1;
+    }
+    struct buddy_trace_header *tr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == tr) {
+        return -1;
+    }
+    memcpy(tr->magic, BUDDY_TRACE_MAGIC, sizeof(tr->magic));
+    tr->version = BUDDY_TRACE_VERSION;
+    tr->record_size = sizeof(struct buddy_trace_record);
+    tr->capacity = records;
+    tr->base = (uint64_t)(uintptr_t)pool->base;
+    tr->numbytes = pool->numbytes;
+    pool->trace = tr;
+    return 0;
+}
+
+void buddy_trace_stop(struct buddy_pool *pool)
+{
+    if (!pool || !pool->trace) {
+        return;
+    }
+    size_t bytes = sizeof(struct buddy_trace_header) + pool->trace->capacity * sizeof(struct buddy_trace_record);
+    munmap(pool->trace, bytes);
+    pool->trace = NULL;
+}
+
+/**
+ * A sampled live block of the heap profiler.
+ */
+struct profile_sample
+{
+    void *ptr;                              /*User pointer, NULL for an empty slot*/
+    size_t size;                            /*Requested size*/
+    size_t depth;                           /*Frames in stack*/
+    void *stack[BUDDY_PROFILE_DEPTH];       /*Return addresses, innermost first*/
+};
+
+/**
+ * Heap profiler state, an open addressing table of the sampled live blocks
+ * keyed by pointer with linear probing, grown by doubling at half full.
+ */
+struct buddy_profile
+{
+    size_t mapbytes;                        /*Size of the mapping holding this struct*/
+    size_t rate;                            /*Mean bytes between samples*/
+    int64_t countdown;                      /*Bytes left until the next sample*/
+    uint64_t rng;                           /*xorshift state for the sample gaps*/
+    size_t live;                            /*Sampled blocks not freed yet*/
+    size_t mask;                            /*Slots in table less one*/
+    char path[PATH_MAX];                    /*Dumped to by buddy_destroy, empty for none*/
+    struct profile_sample table[];
+};
+
+/**
+ * Stack bounds of the calling thread, looked up on its first sample so the
+ * frame pointer walk never reads outside the stack. Zero where they can not
+ * be looked up, which is everywhere but Linux.
+ */
+static __thread uintptr_t profile_stack_lo;
+static __thread uintptr_t profile_stack_hi;
+
+/**
+ * @brief Bytes until the next sample, exponential with mean rate so the
+ * sampled bytes form a Poisson process as in tcmalloc
+ */
+static int64_t profile_gap(struct buddy_profile *prof)
+{
+    prof->rng ^= prof->rng << 13;
+    prof->rng ^= prof->rng >> 7;
+    prof->rng ^= prof->rng << 17;
+    double u = ((double)(prof->rng >> 11) + 1.0) / 9007199254740992.0;
+    return (int64_t)(-log(u) * (double)prof->rate) + 1;
+}
+
+/**
+ * @brief Map a profile with room for slots samples, slots a power of two
+ */
+static struct buddy_profile *profile_map(size_t slots)
+{
+    size_t mapbytes = sizeof(struct buddy_profile) + slots * sizeof(struct profile_sample);
+    struct buddy_profile *prof = mmap(NULL, mapbytes, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == prof) {
+        return NULL;
+    }
+    prof->mapbytes = mapbytes;
+    prof->mask = slots - 1;
+    return prof;
+}
+
+static size_t profile_home(struct buddy_profile *prof, void *ptr)
+{
+    return (size_t)(((uint64_t)(uintptr_t)ptr * UINT64_C(0x9E3779B97F4A7C15)) >> 20) & prof->mask;
+}
+
+/**
+ * @brief The slot holding ptr, or the empty slot it would go in
+ */
+static size_t profile_find(struct buddy_profile *prof, void *ptr)
+{
+    size_t i = profile_home(prof, ptr);
+    while (prof->table[i].ptr && prof->table[i].ptr != ptr) {
+        i = (i + 1) & prof->mask;
+    }
+    return i;
+}
+
+/**
+ * @brief Double the table, returning false if there is no memory for it
+ */
+static bool profile_grow(struct buddy_pool *pool)
+{
+    struct buddy_profile *old = pool->profile;
+    struct buddy_profile *prof = profile_map(2 * (old->mask + 1));
+    if (!prof) {
+        return false;
+    }
+    size_t mapbytes = prof->mapbytes;
+    size_t mask = prof->mask;
+    memcpy(prof, old, sizeof(struct buddy_profile));
+    prof->mapbytes = mapbytes;
+    prof->mask = mask;
+    for (size_t i = 0; i <= old->mask; i++) {
+        if (old->table[i].ptr) {
+            prof->table[profile_find(prof, old->table[i].ptr)] = old->table[i];
+        }
+    }
+    pool->profile = prof;
+    munmap(old, old->mapbytes);
+    return true;
+}
+
+/**
+ * Record a sample of ptr with the stack of the caller. Never inlined so
+ * the first return address on the walk is in the public entry point that
+ * took the sample, which is where pprof expects the allocator frame.
+ */
+__attribute__((noinline)) static void profile_sample(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    struct buddy_profile *prof = pool->profile;
+    prof->countdown = profile_gap(prof);
+    if (2 * (prof->live + 1) > prof->mask + 1 && !profile_grow(pool)) {
+        return;
+    }
+    prof = pool->profile;
+#ifdef __linux__
+    if (!profile_stack_hi) {
+        pthread_attr_t attr;
+        void *addr;
+        size_t bytes;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &addr, &bytes) == 0) {
+                profile_stack_lo = (uintptr_t)addr;
+                profile_stack_hi = (uintptr_t)addr + bytes;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+#endif
+    struct profile_sample *s = &prof->table[profile_find(prof, ptr)];
+    s->ptr = ptr;
+    s->size = size;
+    s->depth = 0;
+    //Without stack bounds only the return address of this frame is trusted
+    if (!profile_stack_hi) {
+        s->stack[s->depth++] = __builtin_return_address(0);
+        prof->live++;
+        return;
+    }
+    //Each frame starts with the caller's frame pointer then the return
+    //address. Stop at anything that leaves the stack or does not move up it.
+    uintptr_t *fp = __builtin_frame_address(0);
+    while (s->depth < BUDDY_PROFILE_DEPTH && (uintptr_t)fp >= profile_stack_lo &&
+           (uintptr_t)(fp + 2) <= profile_stack_hi && ((uintptr_t)fp & (sizeof(uintptr_t) - 1)) == 0 && fp[1]) {
+        s->stack[s->depth++] = (void *)fp[1];
+        if ((uintptr_t *)fp[0] <= fp) {
+            break;
+        }
+        fp = (uintptr_t *)fp[0];
+    }
+    prof->live++;
+}
+
+/**
+ * @brief Count size bytes against the next sample, taking it when due.
+ * Always inlined so no frame of its own shows up in the samples.
+ */
+__attribute__((always_inline)) static inline void profile_malloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    if (!ptr) {
+        return;
+    }
+    bool locked = pool_lock(pool);
+    pool->profile->countdown -= (int64_t)size;
+    if (pool->profile->countdown <= 0) {
+        profile_sample(pool, ptr, size);
+    }
+    pool_unlock(pool, locked);
+}
+
+/**
+ * @brief Drop the sample of ptr once profile->live says there may be one
+ */
+static void profile_drop(struct buddy_profile *prof, void *ptr)
+{
+    size_t i = profile_find(prof, ptr);
+    if (!prof->table[i].ptr) {
+        return;
+    }
+    prof->table[i].ptr = NULL;
+    prof->live--;
+    //Backward shift the rest of the probe run into the hole
+    for (size_t j = (i + 1) & prof->mask; prof->table[j].ptr; j = (j + 1) & prof->mask) {
+        size_t home = profile_home(prof, prof->table[j].ptr);
+        if (((j - home) & prof->mask) >= ((j - i) & prof->mask)) {
+            prof->table[i] = prof->table[j];
+            prof->table[j].ptr = NULL;
+            i = j;
+        }
+    }
+}
+
+/**
+ * @brief Forget ptr if it was sampled
+ */
+static inline void profile_free(struct buddy_pool *pool, void *ptr)
+{
+    if (!__atomic_load_n(&pool->profile->live, __ATOMIC_RELAXED)) {
+        return;
+    }
+    bool locked = pool_lock(pool);
+    profile_drop(pool->profile, ptr);
+    pool_unlock(pool, locked);
+}
+
+/**
+ * @brief Write the profile to path in the gperftools heap_v2 format
+ */
+static int profile_write(struct buddy_profile *prof, const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        return -1;
+    }
+    size_t bytes = 0;
+    for (size_t i = 0; i <= prof->mask; i++) {
+        bytes += prof->table[i].ptr ? prof->table[i].size : 0;
+    }
+    fprintf(out, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n", prof->live, bytes, prof->live, bytes,
+            prof->rate);
+    for (size_t i = 0; i <= prof->mask; i++) {
+        struct profile_sample *s = &prof->table[i];
+        if (!s->ptr) {
+            continue;
+        }
+        fprintf(out, "%6d: %8zu [%6d: %8zu] @", 1, s->size, 1, s->size);
+        for (size_t f = 0; f < s->depth; f++) {
+            fprintf(out, " 0x%016" PRIxPTR, (uintptr_t)s->stack[f]);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+            fwrite(buf, 1, n, out);
+        }
+        fclose(maps);
+    }
+    int failed = ferror(out);
+    if (fclose(out) || failed) {
+        return -1;
+    }
+    return 0;
+}
+
+int buddy_profile_start(struct buddy_pool *pool, size_t rate, const char *path)
+{
+    if (!pool || (path && strlen(path) >= PATH_MAX)) {
+        errno = EINVAL;
+        return -1;
+    }
+    buddy_profile_stop(pool);
+    struct buddy_profile *prof = profile_map(1024);
+    if (!prof) {
+        return -1;
+    }
+    prof->rate = rate ? rate : BUDDY_PROFILE_RATE;
+    prof->rng = (uint64_t)(uintptr_t)pool->base ^ ticks_now() ^ UINT64_C(0x9E3779B97F4A7C15);
+    prof->rng = prof->rng ? prof->rng : 1;
+    prof->countdown = profile_gap(prof);
+    if (path) {
+        strcpy(prof->path, path);
+    }
+    pool->profile = prof;
+    return 0;
+}
+
+int buddy_profile_dump(struct buddy_pool *pool, const char *path)
+{
+    if (!pool || !pool->profile || (!path && !pool->profile->path[0])) {
+        errno = EINVAL;
+        return -1;
+    }
+    bool locked = pool_lock(pool);
+    int rval = profile_write(pool->profile, path ? path : pool->profile->path);
+    pool_unlock(pool, locked);
+    return rval;
+}
+
+void buddy_profile_stop(struct buddy_pool *pool)
+{
+    if (!pool || !pool->profile) {
+        return;
+    }
+    munmap(pool->profile, pool->profile->mapbytes);
+    pool->profile = NULL;
+}
+
+void *buddy_malloc(struct buddy_pool *pool, size_t size)
+{
+    if (!pool || size == 0) {
+        errno = EINVAL; // Invalid input
+        return NULL;
+    }
+    HIST_START();
+    void *ptr;
+    bool locked = pool_lock(pool);
+    cost_mark(pool);
+    ptr = pool_malloc(pool, size);
+    pool_unlock(pool, locked);
+    HIST_RECORD(pool, BUDDY_OP_MALLOC, size);
+    if (pool->trace) {
+        trace_record(pool, BUDDY_OP_MALLOC, size, ptr, NULL);
+    }
+    if (pool->profile) {
+        profile_malloc(pool, ptr, size);
+    }
+    return ptr;
+}
+
+/**
+ * @brief buddy_stats once the arguments have been checked and the pool is
+ * locked if it needs to be.
+ */
+static void pool_stats(struct buddy_pool *pool, struct buddy_stats *out)
+{
+    *out = pool->stats;
+    out->last.splits = pool->stats.cost.splits - pool->cost_mark.splits;
+    out->last.merges = pool->stats.cost.merges - pool->cost_mark.merges;
+    out->last.links = pool->stats.cost.links - pool->cost_mark.links;
+    out->last.copied = pool->stats.cost.copied - pool->cost_mark.copied;
+    out->hist = pool->hist;
+    out->largest_free = 0;
+    for (size_t k = 0; k <= pool->kval_m; k++) {
+        out->parked_blocks[k] = pool->lazy_count[k];
+        if (out->free_blocks[k]) {
+            out->largest_free = k;
+        }
+    }
+}
+
+int buddy_stats(struct buddy_pool *pool, struct buddy_stats *out)
+{
+    if (!pool || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    bool locked = pool_lock(pool);
+    pool_stats(pool, out);
+    pool_unlock(pool, locked);
+    return 0;
+}
+
+void *buddy_malloc_usable(struct buddy_pool *pool, size_t size, size_t *usable)
+{
+    if (!pool || size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    HIST_START();
+    void *ptr;
+    bool locked = pool_lock(pool);
+    cost_mark(pool);
+    ptr = pool_malloc_usable(pool, size, usable);
+    pool_unlock(pool, locked);
+    HIST_RECORD(pool, BUDDY_OP_MALLOC, size);
+    if (pool->trace) {
+        trace_record(pool, BUDDY_OP_MALLOC, size, ptr, NULL);
+    }
+    if (pool->profile) {
+        profile_malloc(pool, ptr, size);
+    }
+    return ptr;
+}
+
+size_t buddy_usable_size(struct buddy_pool *pool, void *ptr)
+{
+    if (!pool || !ptr) {
+        return 0;
+    }
+    bool locked = pool_lock(pool);
+    size_t usable = pool_usable_size(pool, ptr);
+    pool_unlock(pool, locked);
+    return usable;
+}
+
+void *buddy_malloc_hint(struct buddy_pool *pool, size_t size, int hint)
+{
+    if (!pool || size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (hint != BUDDY_HINT_SHORT && hint != BUDDY_HINT_LONG) {
+        return buddy_malloc(pool, size);
+    }
+    // Long lived data packs up from the bottom of the pool and short lived
+    // data down from the top so the two never share a subtree until they meet.
+    enum place place = hint == BUDDY_HINT_SHORT ? PLACE_TOP : PLACE_BOTTOM;
+    HIST_START();
+    void *ptr;
+    bool locked = pool_lock(pool);
+    cost_mark(pool);
+    ptr = pool_malloc_placed(pool, size, place);
+    pool_unlock(pool, locked);
+    HIST_RECORD(pool, BUDDY_OP_MALLOC, size);
+    if (pool->trace) {
+        trace_record(pool, BUDDY_OP_MALLOC, size, ptr, NULL);
+    }
+    if (pool->profile) {
+        profile_malloc(pool, ptr, size);
+    }
+    return ptr;
+}
+
+void *buddy_malloc_near(struct buddy_pool *pool, size_t size, void *hint)
+{
+    if (!pool || size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t offset = (size_t)((uintptr_t)hint - (uintptr_t)pool->base);
+    if (!hint || offset >= pool->numbytes) {
+        return buddy_malloc(pool, size);
+    }
+    HIST_START();
+    void *ptr;
+    bool locked = pool_lock(pool);
+    cost_mark(pool);
+    ptr = pool_malloc_near(pool, size, offset);
+    pool_unlock(pool, locked);
+    HIST_RECORD(pool, BUDDY_OP_MALLOC, size);
+    if (pool->trace) {
+        trace_record(pool, BUDDY_OP_MALLOC, size, ptr, NULL);
+    }
+    if (pool->profile) {
+        profile_malloc(pool, ptr, size);
+    }
+    return ptr;
+}
+
+void *buddy_malloc_range(struct buddy_pool *pool, size_t min, size_t max, size_t *got)
+{
+    if (!pool || min == 0 || min > max) {
+        errno = EINVAL;
+        return NULL;
+    }
+    HIST_START();
+    void *ptr;
+    // The hooks see the size handed out, which is what a later free gives back
+    size_t size = min;
+    bool locked = pool_lock(pool);
+    cost_mark(pool);
+    ptr = pool_malloc_range(pool, min, max, &size);
+    pool_unlock(pool, locked);
+    if (ptr && got) {
+        *got = size;
+    }
+    HIST_RECORD(pool, BUDDY_OP_MALLOC, size);
+    if (pool->trace) {
+        trace_record(pool, BUDDY_OP_MALLOC, size, ptr, NULL);
+    }
+    if (pool->profile) {
+        profile_malloc(pool, ptr, size);
+    }
+    return ptr;
+}
+
+void buddy_free(struct buddy_pool *pool, void *ptr)
+{
+    if (!pool || !ptr) {
+        return; // Do nothing if the pointer or pool is NULL.
+    }
+    // Traced before the block can be reused so the trace keeps call order
+    if (pool->trace) {
+        trace_record(pool, BUDDY_OP_FREE, 0, ptr, NULL);
+    }
+    if (pool->profile) {
+        profile_free(pool, ptr);
+    }
+    HIST_START_FREE(pool, ptr);
+    bool locked = pool_lock(pool);
+    cost_mark(pool);
+    pool_free(pool, ptr);
+    pool_unlock(pool, locked);
+    HIST_RECORD(pool, BUDDY_OP_FREE, hist_size);
+}
+
+void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    if (!pool || !ptr) {
+        return;
+    }
+    // Traced before the block can be reused so the trace keeps call order
+    if (pool->trace) {
+        trace_record(pool, BUDDY_OP_FREE, 0, ptr, NULL);
+    }
+    if (pool->profile) {
+        profile_free(pool, ptr);
+    }
+    HIST_START_FREE(pool, ptr);
+    bool locked = pool_lock(pool);
+    cost_mark(pool);
+    pool_free_sized(pool, ptr, size);
+    pool_unlock(pool, locked);
+    HIST_RECORD(pool, BUDDY_OP_FREE, hist_size);
+}
+
+void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    if (!pool)
+        return NULL;
+    if (!ptr)
+        return buddy_malloc(pool, size);
+    if (size == 0) {
+        buddy_free(pool, ptr);
+        return NULL;
+    }
+    HIST_START();
+    void *new_ptr;
+    bool locked = pool_lock(pool);
+    cost_mark(pool);
+    new_ptr = pool_realloc(pool, ptr, size);
+    pool_unlock(pool, locked);
+    HIST_RECORD(pool, BUDDY_OP_REALLOC, size);
+    if (pool->trace) {
+        trace_record(pool, BUDDY_OP_REALLOC, size, new_ptr, ptr);
+    }
+    if (pool->profile && new_ptr) {
+        profile_free(pool, ptr);
+        profile_malloc(pool, new_ptr, size);
+    }
+    return new_ptr;
+}
+
+/**
+ * The smallest chunk an arena will use. Anything smaller spends most of
+ * the chunk on the block header, chunk link and arena struct.
+ */
+#define ARENA_MIN_K 8
+
+/**
+ * The default alignment for arena allocations.
+ */
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+/**
+ * @brief Take a chunk of the given order from the pool and push it on the
+ * arena chunk chain.
+ *
+ * @param arena The arena to grow
+ * @param kval The order of the chunk
+ * @return char* the first usable byte after the chunk link or NULL
+ */
+static char *arena_chunk(struct buddy_arena *arena, size_t kval)
+{
+    void **chunk = buddy_malloc(arena->pool, (UINT64_C(1) << kval) - sizeof(struct avail));
+    if (!chunk) {
+        return NULL;
+    }
+    *chunk = arena->chunks;
+    arena->chunks = chunk;
+    return (char *)(chunk + 1);
+}
+
+struct buddy_arena *buddy_arena_create(struct buddy_pool *pool, size_t chunk_order)
+{
+    if (!pool || chunk_order > pool->kval_m) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (chunk_order < ARENA_MIN_K) {
+        chunk_order = ARENA_MIN_K;
+    }
+
+    //The arena lives at the front of its own first chunk
+    struct buddy_arena tmp = {pool, chunk_order, NULL, NULL, NULL};
+    char *start = arena_chunk(&tmp, chunk_order);
+    if (!start) {
+        return NULL;
+    }
+    struct buddy_arena *arena = (struct buddy_arena *)start;
+    *arena = tmp;
+    arena->cur = start + sizeof(struct buddy_arena);
+    arena->end = (char *)tmp.chunks + (UINT64_C(1) << chunk_order) - sizeof(struct avail);
+    return arena;
+}
+
+void *buddy_arena_alloc(struct buddy_arena *arena, size_t size, size_t align)
+{
+    if (!arena || size == 0 || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (align < ARENA_ALIGN) {
+        align = ARENA_ALIGN;
+    }
+
+    //Fast path bump the pointer in the current chunk
+    uintptr_t p = ((uintptr_t)arena->cur + align - 1) & ~(uintptr_t)(align - 1);
+    if (p <= (uintptr_t)arena->end && size <= (uintptr_t)arena->end - p) {
+        arena->cur = (char *)(p + size);
+        return (void *)p;
+    }
+
+    //Worst case a chunk needs room for the block header, chunk link and alignment padding
+    size_t overhead = sizeof(struct avail) + sizeof(void *) + align - 1;
+    size_t chunk_bytes = UINT64_C(1) << arena->chunk_order;
+    if (size > chunk_bytes - overhead) {
+        //Too big for a regular chunk so give it a dedicated one and keep
+        //bumping in the current chunk
+        if (size > SIZE_MAX - overhead) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        void *head = arena->chunks;
+        char *start = arena_chunk(arena, btok(size + overhead));
+        if (!start) {
+            return NULL;
+        }
+        //Keep the current chunk at the head of the chain
+        void **big = arena->chunks;
+        arena->chunks = head;
+        *big = *(void **)head;
+        *(void **)head = big;
+        return (void *)(((uintptr_t)start + align - 1) & ~(uintptr_t)(align - 1));
+    }
+
+    char *start = arena_chunk(arena, arena->chunk_order);
+    if (!start) {
+        return NULL;
+    }
+    arena->end = (char *)arena->chunks + chunk_bytes - sizeof(struct avail);
+    p = ((uintptr_t)start + align - 1) & ~(uintptr_t)(align - 1);
+    arena->cur = (char *)(p + size);
+    return (void *)p;
+}
+
+void buddy_arena_destroy(struct buddy_arena *arena)
+{
+    if (!arena) {
+        return;
+    }
+    //The arena is in the oldest chunk so copy out what we need first
+    struct buddy_pool *pool = arena->pool;
+    void *chunk = arena->chunks;
+    while (chunk) {
+        void *next = *(void **)chunk;
+        buddy_free(pool, chunk);
+        chunk = next;
+    }
+}
+
+/**
+ * @brief A mapping parked in the process wide mapping cache.
+ */
+struct cache_entry
+{
+    void *base;                 /*Base address of the cached mapping*/
+    size_t kval;                /*The order of the cached mapping*/
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    size_t limit;
+    size_t count;
+    int scrub;
+    struct cache_entry entries[BUDDY_CACHE_MAX];
+} map_cache = {PTHREAD_MUTEX_INITIALIZER, 0, 0, BUDDY_CACHE_KEEP, {{0}}}; //Off until buddy_cache_config
+
+/**
+ * @brief Take a mapping of order kval out of the cache.
+ *
+ * @param kval The order of the mapping needed
+ * @return void* the cached mapping or NULL if there is none
+ */
+static void *cache_take(size_t kval)
+{
+    void *base = NULL;
+    pthread_mutex_lock(&map_cache.lock);
+    for (size_t i = 0; i < map_cache.count; i++) {
+        if (map_cache.entries[i].kval == kval) {
+            base = map_cache.entries[i].base;
+            map_cache.entries[i] = map_cache.entries[--map_cache.count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&map_cache.lock);
+    return base;
+}
+
+/**
+ * @brief Park a mapping in the cache.
+ *
+ * @param base The mapping to park
+ * @param kval The order of the mapping
+ * @return true if the cache took ownership of the mapping
+ */
+static bool cache_give(void *base, size_t kval)
+{
+    pthread_mutex_lock(&map_cache.lock);
+    bool room = map_cache.count < map_cache.limit;
+    bool scrub = map_cache.scrub == BUDDY_CACHE_DONTNEED;
+    pthread_mutex_unlock(&map_cache.lock);
+    if (!room) {
+        return false;
+    }
+    //Scrub before the mapping is visible to cache_take, and outside the lock
+    //so a large madvise does not hold up every other init and destroy
+    if (scrub) {
+        madvise(base, UINT64_C(1) << kval, MADV_DONTNEED);
+    }
+    pthread_mutex_lock(&map_cache.lock);
+    bool taken = map_cache.count < map_cache.limit;
+    if (taken) {
+        map_cache.entries[map_cache.count].base = base;
+        map_cache.entries[map_cache.count].kval = kval;
+        map_cache.count++;
+    }
+    pthread_mutex_unlock(&map_cache.lock);
+    return taken;
+}
+
+/**
+ * @brief Unmap cached mappings until at most keep are left. Must be called
+ * with the cache lock held.
+ *
+ * @param keep The number of mappings to keep
+ * @return size_t the number of mappings released
+ */
+static size_t cache_trim(size_t keep)
+{
+    size_t released = 0;
+    while (map_cache.count > keep) {
+        struct cache_entry *e = &map_cache.entries[--map_cache.count];
+        if (-1 == munmap(e->base, UINT64_C(1) << e->kval)) {
+            handle_error_and_die("buddy cache munmap failed");
+        }
+        released++;
+    }
+    return released;
+}
+
+void buddy_cache_config(size_t max_entries, int scrub)
+{
+    if (max_entries > BUDDY_CACHE_MAX)
+        max_entries = BUDDY_CACHE_MAX;
+
+    pthread_mutex_lock(&map_cache.lock);
+    map_cache.limit = max_entries;
+    map_cache.scrub = scrub;
+    cache_trim(max_entries);
+    pthread_mutex_unlock(&map_cache.lock);
+}
+
+size_t buddy_cache_flush(void)
+{
+    pthread_mutex_lock(&map_cache.lock);
+    size_t released = cache_trim(0);
+    pthread_mutex_unlock(&map_cache.lock);
+    return released;
+}
+
+/**
+ * @brief Convert a requested pool size to the kval of the pool, applying
+ * the default and the MIN_K/MAX_K limits.
+ *
+ * @param size The requested pool size in bytes, 0 for the default
+ * @return size_t the kval of the pool
+ */
+static size_t pool_kval(size_t size)
+{
+    size_t kval = 0;
+    if (size == 0)
+        kval = DEFAULT_K;
+    else
+        kval = btok(size);
+
+    if (kval < MIN_K)
         kval = MIN_K;
-    if (kval > MAX_K)
+    // avail has MAX_K lists, so MAX_K itself is already too large
+    if (kval >= MAX_K)
         kval = MAX_K - 1;
+    return kval;
+}
 
-    //make sure pool struct is cleared out
-    memset(pool,0,sizeof(struct buddy_pool));
-    pool->kval_m = kval;
-    pool->numbytes = (UINT64_C(1) << pool->kval_m);
-    //Memory map a block of raw memory to manage
-    pool->base = mmap(
-        NULL,                               /*addr to map to*/
-        pool->numbytes,                     /*length*/
-        PROT_READ | PROT_WRITE,             /*prot*/
-        MAP_PRIVATE | MAP_ANONYMOUS,        /*flags*/
-        -1,                                 /*fd -1 when using MAP_ANONYMOUS*/
-        0                                   /* offset 0 when using MAP_ANONYMOUS*/
-    );
-    if (MAP_FAILED == pool->base)
-    {
-        handle_error_and_die("buddy_init avail array mmap failed");
-    }
+/**
+ * @brief Set up the avail lists of a pool whose kval_m, numbytes and base
+ * have been filled in so the whole memory region is one free block.
+ *
+ * @param pool The memory pool
+ */
+static void pool_setup(struct buddy_pool *pool)
+{
+    size_t kval = pool->kval_m;
+    pool->seg_k = BUDDY_SEG_K;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->rt_wake, NULL);
 
     //Set all blocks to empty. We are using circular lists so the first elements just point
     //to an available block. Thus the tag, and kval feild are unused burning a small bit of
@@ -241,22 +2571,130 @@ void buddy_init(struct buddy_pool *pool, size_t size)
         pool->avail[i].next = pool->avail[i].prev = &pool->avail[i];
         pool->avail[i].kval = i;
         pool->avail[i].tag = BLOCK_UNUSED;
+        pool->lazy[i].next = pool->lazy[i].prev = &pool->lazy[i];
+        pool->lazy[i].kval = i;
+        pool->lazy[i].tag = BLOCK_UNUSED;
     }
 
     //Add in the first block
     pool->avail[kval].next = pool->avail[kval].prev = (struct avail *)pool->base;
     struct avail *m = pool->avail[kval].next;
-    m->tag = BLOCK_AVAIL;
+    m->tag = pool->parent ? BLOCK_RESERVED : BLOCK_AVAIL;
     m->kval = kval;
     m->next = m->prev = &pool->avail[kval];
+    pool->stats.free_blocks[kval] = 1;
+
+#ifdef BUDDY_HISTOGRAMS
+    //Only the buckets that are hit get backed by memory
+    pool->hist = mmap(NULL, sizeof(struct buddy_histograms), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == pool->hist) {
+        pool->hist = NULL;
+    }
+#endif
+}
+
+void buddy_init(struct buddy_pool *pool, size_t size)
+{
+    size_t kval = pool_kval(size);
+
+    //make sure pool struct is cleared out
+    memset(pool,0,sizeof(struct buddy_pool));
+    pool->kval_m = kval;
+    pool->numbytes = (UINT64_C(1) << pool->kval_m);
+    //Reuse a recently destroyed mapping of the same order if we have one,
+    //otherwise memory map a block of raw memory to manage
+    pool->base = cache_take(kval);
+    if (!pool->base)
+        pool->base = mmap(
+            NULL,                               /*addr to map to*/
+            pool->numbytes,                     /*length*/
+            PROT_READ | PROT_WRITE,             /*prot*/
+            MAP_PRIVATE | MAP_ANONYMOUS,        /*flags*/
+            -1,                                 /*fd -1 when using MAP_ANONYMOUS*/
+            0                                   /* offset 0 when using MAP_ANONYMOUS*/
+        );
+    if (MAP_FAILED == pool->base)
+    {
+        handle_error_and_die("buddy_init avail array mmap failed");
+    }
+
+    pool_setup(pool);
+}
+
+int buddy_init_child(struct buddy_pool *parent, struct buddy_pool *child, size_t size)
+{
+    if (!parent || !child) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t kval = pool_kval(size);
+
+    //The whole parent block becomes the child memory, the child writes its
+    //own headers into it. The parent may be in real-time mode so the carve
+    //goes under its lock like any other allocation.
+    //The child uses all of it, so none of it is internal fragmentation
+    bool locked = pool_lock(parent);
+    struct avail *block = block_take(parent, kval);
+    if (block) {
+        parent->stats.requested += (size_t)1 << kval;
+    }
+    pool_unlock(parent, locked);
+    if (!block) {
+        return -1;
+    }
+
+    memset(child,0,sizeof(struct buddy_pool));
+    child->kval_m = kval;
+    child->numbytes = (UINT64_C(1) << child->kval_m);
+    child->base = block;
+    child->parent = parent;
+    //The top block stays tagged reserved while it sits on the child free
+    //list so the parent never tries to coalesce with it
+    pool_setup(child);
+    return 0;
 }
 
 void buddy_destroy(struct buddy_pool *pool)
 {
-    int rval = munmap(pool->base, pool->numbytes);
-    if (-1 == rval)
+    buddy_rt_stop(pool);
+    pthread_cond_destroy(&pool->rt_wake);
+    pthread_mutex_destroy(&pool->lock);
+    if (pool->slabs)
+    {
+        munmap(pool->slabs, pool->slabs->mapbytes);
+    }
+    if (pool->index)
+    {
+        munmap(pool->index, pool->index->mapbytes);
+    }
+    if (pool->hist)
+    {
+        munmap(pool->hist, sizeof(struct buddy_histograms));
+    }
+    buddy_trace_stop(pool);
+    if (pool->profile && pool->profile->path[0])
+    {
+        buddy_profile_dump(pool, NULL);
+    }
+    buddy_profile_stop(pool);
+    if (pool->parent)
+    {
+        //Hand the block back to the parent so it can coalesce
+        struct avail *block = (struct avail *)pool->base;
+        block->kval = pool->kval_m;
+        bool locked = pool_lock(pool->parent);
+        pool->parent->stats.requested -= (size_t)1 << pool->kval_m;
+        block_release(pool->parent, block);
+        pool_unlock(pool->parent, locked);
+    }
+    else if (!cache_give(pool->base, pool->kval_m))
     {
-        handle_error_and_die("buddy_destroy avail array");
+        int rval = munmap(pool->base, pool->numbytes);
+        if (-1 == rval)
+        {
+            handle_error_and_die("buddy_destroy avail array");
+        }
     }
     //Zero out the array so it can be reused it needed
     memset(pool,0,sizeof(struct buddy_pool));
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 
 #ifdef __cplusplus
@@ -34,9 +35,68 @@ extern "C"
    */
 #define SMALLEST_K 6
 
+  /**
+   * The maximum number of destroyed pool mappings that can be held in the
+   * process wide mapping cache. The active limit is set with buddy_cache_config.
+   */
+#define BUDDY_CACHE_MAX 16
+
+  /**
+   * A reasonable number of mappings to cache when turning the cache on with
+   * buddy_cache_config. The cache starts disabled, so buddy_destroy returns
+   * memory to the OS unless a program opts in.
+   */
+#define BUDDY_CACHE_DEFAULT 4
+
+#define BUDDY_CACHE_KEEP     0  /*Cached mappings keep their pages resident*/
+#define BUDDY_CACHE_DONTNEED 1  /*Cached mappings are released with MADV_DONTNEED*/
+
+  /**
+   * The kval of the blocks the small object front end carves into slabs.
+   */
+#define BUDDY_SLAB_K 12
+
+  /**
+   * The largest request the small object front end will serve. Larger
+   * requests always get a buddy block.
+   */
+#define BUDDY_SLAB_MAX 1024
+
+  /**
+   * The number of extra size classes the small object front end can learn
+   * from profiling with buddy_slab_profile.
+   */
+#define BUDDY_SLAB_LEARNED 4
+
+#define BUDDY_POLICY_LIFO    0  /*Take the most recently freed block of the smallest order that fits*/
+#define BUDDY_POLICY_ADDRESS 1  /*Take the lowest addressed block of the smallest order that fits*/
+#define BUDDY_POLICY_SEGREGATED 2 /*Small requests from the bottom of the pool, large ones from the top*/
+
+  /**
+   * The default order at which BUDDY_POLICY_SEGREGATED switches from the
+   * bottom of the pool to the top.
+   */
+#define BUDDY_SEG_K 16
+
+  /**
+   * The largest subtree buddy_malloc_near searches around its hint, 64 KiB.
+   */
+#define BUDDY_NEAR_K 16
+
+  /**
+   * Cache coloring offsets user data in steps of BUDDY_COLOR_LINE bytes, and
+   * only in blocks of order BUDDY_COLOR_K or larger.
+   */
+#define BUDDY_COLOR_LINE 64
+#define BUDDY_COLOR_K 12
+
+#define BUDDY_HINT_SHORT 1  /*The allocation is short lived, for example per request state*/
+#define BUDDY_HINT_LONG  2  /*The allocation is long lived, for example per connection state*/
+
 #define BLOCK_AVAIL    1  /*Block is available to allocate*/
 #define BLOCK_RESERVED 0  /*Block has been handed to user*/
 #define BLOCK_UNUSED   3  /*Block is not used at all*/
+#define BLOCK_COLORED  4  /*Header in front of colored user data, next is the block*/
 
   /**
    * Struct to represent the table of all available blocks do not reorder members
@@ -50,6 +110,125 @@ extern "C"
     struct avail *prev;         /*prev memory block*/
   };
 
+  struct buddy_slabs;
+  struct buddy_index;
+  struct buddy_profile;
+
+  /**
+   * Work done by the allocator, counted instead of timed so tests can hold
+   * it to fixed bounds on any machine.
+   */
+  struct buddy_cost
+  {
+    size_t splits;              /*Blocks split in two*/
+    size_t merges;              /*Buddies merged back together*/
+    size_t links;               /*Blocks pushed on or unlinked from a list*/
+    size_t copied;              /*Bytes copied by realloc*/
+  };
+
+  /**
+   * Operations the latency histograms are kept for.
+   */
+#define BUDDY_OP_MALLOC  0
+#define BUDDY_OP_FREE    1
+#define BUDDY_OP_REALLOC 2
+#define BUDDY_OPS        3
+
+  /**
+   * Latency histograms are log-linear: every power of two is split into
+   * BUDDY_HIST_SUB buckets, enough for 64 bit tick counts.
+   */
+#define BUDDY_HIST_SUB 8
+#define BUDDY_HIST_BUCKETS (2 * BUDDY_HIST_SUB + 60 * BUDDY_HIST_SUB)
+
+  /**
+   * Latency of every public call by operation and requested order, only kept
+   * when the library is built with BUDDY_HISTOGRAMS. Mallocs count under the
+   * order of the request, frees under the order of the freed block. Ticks
+   * are TSC cycles on x86 and nanoseconds elsewhere, buddy_hist_floor gives
+   * the smallest tick count of a bucket.
+   */
+  struct buddy_histograms
+  {
+    uint64_t count[BUDDY_OPS][MAX_K][BUDDY_HIST_BUCKETS];
+  };
+
+  /**
+   * Allocation trace file. The file is a struct buddy_trace_header followed
+   * by capacity struct buddy_trace_record slots used as a ring: record n of
+   * the trace is in slot n % capacity, and head is the number of records
+   * ever written, so the last min(head, capacity) records are in the file.
+   * All fields are in the byte order of the host that wrote the trace.
+   * A realloc is one BUDDY_OP_REALLOC record holding both the old and the
+   * new offset. Every time the ring wraps, wraps is bumped, so a reader can
+   * tell head - capacity records were overwritten. The newest records may be
+   * torn when a traced process dies mid call.
+   */
+#define BUDDY_TRACE_MAGIC "BUDDYTR1"
+#define BUDDY_TRACE_VERSION 2
+#define BUDDY_TRACE_NULL UINT64_MAX         /*Offset of a NULL pointer*/
+
+  struct buddy_trace_header
+  {
+    char magic[8];              /*BUDDY_TRACE_MAGIC without the terminating NUL*/
+    uint32_t version;           /*BUDDY_TRACE_VERSION*/
+    uint32_t record_size;       /*sizeof(struct buddy_trace_record), 40*/
+    uint64_t capacity;          /*Number of record slots after the header*/
+    uint64_t head;              /*Number of records written so far*/
+    uint64_t base;              /*Address of the traced pool*/
+    uint64_t numbytes;          /*Size of the traced pool*/
+    uint64_t wraps;             /*Times writing wrapped around to slot 0 and overwrote the oldest records*/
+    uint64_t reserved;          /*Zero, pads the header to 64 bytes*/
+  };
+
+  struct buddy_trace_record
+  {
+    uint64_t tsc;               /*Ticks when the call returned, TSC cycles on x86*/
+    uint64_t size;              /*Requested size, 0 for a free*/
+    uint64_t offset;            /*Pointer returned or freed less base, BUDDY_TRACE_NULL for NULL*/
+    uint64_t old_offset;        /*Pointer passed to realloc less base, BUDDY_TRACE_NULL for NULL or other ops*/
+    uint32_t tid;               /*Kernel thread id of the caller on Linux, low bits of pthread_self elsewhere*/
+    uint16_t op;                /*BUDDY_OP_MALLOC, BUDDY_OP_FREE or BUDDY_OP_REALLOC*/
+    uint16_t flags;             /*Zero*/
+  };
+
+  /**
+   * Counters of a pool, kept up to date on every call and copied out by
+   * buddy_stats. Reserved bytes are whole blocks, including the pages of the
+   * slab layer and child pools. Requested bytes are what live allocations
+   * asked for, slab objects count as their class size.
+   */
+  struct buddy_stats
+  {
+    size_t free_blocks[MAX_K];  /*Blocks of each order on the avail lists*/
+    size_t parked_blocks[MAX_K];/*Lazily freed blocks of each order waiting to coalesce*/
+    size_t used_blocks[MAX_K];  /*Blocks of each order handed out of the pool*/
+    size_t requested;           /*Bytes asked for by live allocations*/
+    size_t reserved;            /*Bytes of the blocks handed out*/
+    size_t high_water;          /*Most bytes reserved at any one time*/
+    size_t largest_free;        /*Order of the largest free block, 0 when nothing is free*/
+    size_t failures;            /*Requests that could not be met*/
+    struct buddy_cost cost;     /*Work done over the life of the pool*/
+    struct buddy_cost last;     /*Work done by the last malloc, free or realloc call*/
+    const struct buddy_histograms *hist; /*Live latency histograms, NULL unless built with BUDDY_HISTOGRAMS*/
+  };
+
+  /**
+   * What the small object front end has learned from profiling.
+   */
+  struct buddy_slab_report
+  {
+    size_t samples;                         /*Requests sampled over all profiling windows*/
+    bool profiling;                         /*A profiling window is still open*/
+    size_t learned;                         /*Number of learned classes in use*/
+    size_t size[BUDDY_SLAB_LEARNED];        /*Object size of each learned class*/
+    size_t replaces[BUDDY_SLAB_LEARNED];    /*Usable size the same requests got before the class existed*/
+    size_t allocs[BUDDY_SLAB_LEARNED];      /*Objects each learned class has handed out*/
+    size_t live[BUDDY_SLAB_LEARNED];        /*Objects of each learned class still in use*/
+    size_t saved_bytes;                     /*Internal fragmentation avoided over all learned allocations*/
+    size_t live_saved_bytes;                /*Internal fragmentation avoided by the live learned objects*/
+  };
+
   /**
    * The buddy memory pool.
    */
@@ -59,6 +238,42 @@ extern "C"
     size_t numbytes;            /*The number of bytes this pool is managing*/
     void *base;                 /*Base address used to scale memory for buddy calculations*/
     struct avail avail[MAX_K];  /*The array of available memory blocks*/
+    struct buddy_pool *parent;  /*The pool base was allocated from, NULL if base was mapped*/
+    struct buddy_slabs *slabs;  /*Small object front end, NULL until buddy_slab_enable*/
+    struct buddy_index *index;  /*Address index of the avail lists, NULL until a policy needs it*/
+    int policy;                 /*Placement policy, one of the BUDDY_POLICY values*/
+    size_t seg_k;               /*Orders from here up are placed at the top with BUDDY_POLICY_SEGREGATED*/
+    size_t lazy_limit;          /*Freed blocks parked per order before coalescing, 0 to always coalesce*/
+    size_t lazy_count[MAX_K];   /*Number of blocks parked on each lazy list*/
+    struct avail lazy[MAX_K];   /*Freed blocks waiting to be coalesced, kept tagged reserved*/
+    pthread_mutex_t lock;       /*Serializes callers with the refill thread in real-time mode*/
+    pthread_cond_t rt_wake;     /*Wakes the refill thread when it has to stop*/
+    pthread_t rt_thread;        /*The background refill thread*/
+    bool rt_running;            /*Real-time mode is on, read and written with __atomic builtins*/
+    bool rt_stop;               /*Asks the refill thread to exit*/
+    unsigned int rt_interval_us;/*How long the refill thread sleeps when there is nothing to do*/
+    size_t rt_reserve[MAX_K];   /*Pre-split blocks to keep parked per order in real-time mode*/
+    size_t colors;              /*Number of cache coloring offsets, 0 when coloring is off*/
+    size_t color_next;          /*Color of the next large block*/
+    struct buddy_stats stats;   /*Counters, parked_blocks, largest_free and last are filled in on demand*/
+    struct buddy_cost cost_mark;/*stats.cost when the last call started*/
+    struct buddy_histograms *hist;/*Latency histograms when built with BUDDY_HISTOGRAMS*/
+    struct buddy_trace_header *trace;/*Mapped trace file while tracing*/
+    struct buddy_profile *profile;/*Sampled live blocks while heap profiling*/
+  };
+
+  /**
+   * A bump pointer arena carved from blocks of a buddy pool. Every allocation
+   * made from the arena shares its lifetime and is released all at once by
+   * buddy_arena_destroy. The arena struct itself lives in the first chunk.
+   */
+  struct buddy_arena
+  {
+    struct buddy_pool *pool;    /*The pool chunks are taken from*/
+    size_t chunk_order;         /*The kval of a regular chunk*/
+    void *chunks;               /*Most recent chunk, chunks are chained through their first word*/
+    char *cur;                  /*Next free byte in the current chunk*/
+    char *end;                  /*One past the last usable byte in the current chunk*/
   };
 
   /**
@@ -91,6 +306,86 @@ extern "C"
    */
   void *buddy_malloc(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Allocates a block of size bytes like buddy_malloc, steering it by its
+   * expected lifetime. Long lived blocks are placed in the lowest addressed
+   * free block and short lived ones in the highest, so the two lifetimes
+   * grow from opposite ends of the pool and live in different top level
+   * subtrees until the pool is nearly full. Short lived regions then coalesce
+   * back into large blocks as soon as their requests finish.
+   *
+   * Hinted requests always get a buddy block, they bypass the slab layer and
+   * the lazy lists. The address index is built on first use. A hint other
+   * than BUDDY_HINT_SHORT or BUDDY_HINT_LONG behaves like buddy_malloc. The
+   * block is freed with buddy_free.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @param hint BUDDY_HINT_SHORT or BUDDY_HINT_LONG
+   * @return A pointer to the memory block
+   */
+  void *buddy_malloc_hint(struct buddy_pool *pool, size_t size, int hint);
+
+  /**
+   * Allocates a block of size bytes as close as possible to hint, for example
+   * a new tree node next to its parent. The free block chosen is the one that
+   * shares the smallest buddy subtree with hint, searched up to subtrees of
+   * order BUDDY_NEAR_K. When nothing that fits is free that close, or hint
+   * is NULL or not in the pool, this behaves like buddy_malloc.
+   *
+   * Blocks placed near their hint bypass the slab layer. The address index
+   * is built on first use. The block is freed with buddy_free.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @param hint Any address inside a live allocation from this pool
+   * @return A pointer to the memory block
+   */
+  void *buddy_malloc_near(struct buddy_pool *pool, size_t size, void *hint);
+
+  /**
+   * Allocates the largest block that is free right now with a usable size
+   * from min to max bytes, for callers such as I/O readers that can use any
+   * buffer size in that range. A free block of the largest fitting order is
+   * used as is, a larger one is only split down to the largest block within
+   * max. The usable size of the block, which is at least min, is stored in
+   * got.
+   *
+   * The block always comes from the buddy lists, never the slab layer, and
+   * is freed with buddy_free.
+   *
+   * @param pool The memory pool to alloc from
+   * @param min The smallest size in bytes the caller can work with
+   * @param max The largest size in bytes the caller has use for
+   * @param got Set to the usable size of the block, may be NULL
+   * @return A pointer to the memory block
+   */
+  void *buddy_malloc_range(struct buddy_pool *pool, size_t min, size_t max, size_t *got);
+
+  /**
+   * Allocates a block of size bytes like buddy_malloc and stores how many
+   * bytes of it can actually be used in usable. A 100 byte request lands in
+   * a 128 byte block with 104 usable bytes, so a growing buffer can fill all
+   * of them before it has to reallocate.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @param usable Set to the usable size of the block, may be NULL
+   * @return A pointer to the memory block
+   */
+  void *buddy_malloc_usable(struct buddy_pool *pool, size_t size, size_t *usable);
+
+  /**
+   * The number of bytes that can be used at ptr, at least the size it was
+   * requested with. For a buddy block this is the block size less the
+   * header (and any coloring offset), for a slab object its class size.
+   *
+   * @param pool The memory pool ptr came from
+   * @param ptr A live allocation from pool
+   * @return The usable size in bytes, 0 when ptr is NULL
+   */
+  size_t buddy_usable_size(struct buddy_pool *pool, void *ptr);
+
   /**
    * A block of memory previously allocated by a call to malloc,
    * calloc or realloc is deallocated, making it available again
@@ -108,6 +403,20 @@ extern "C"
    */
   void buddy_free(struct buddy_pool *pool, void *ptr);
 
+  /**
+   * Frees a block whose size the caller knows, without reading the header
+   * in front of ptr. The block is ptr rounded down to the order size maps
+   * to, and the requested bytes of buddy_stats drop by size, so pass the
+   * size ptr was requested with to keep them exact. Builds without NDEBUG
+   * check size against the header and abort on a mismatch. In NDEBUG
+   * builds a size outside the allowed range frees the wrong block.
+   *
+   * @param pool The memory pool
+   * @param ptr Pointer to the memory block to free
+   * @param size Any size from the one ptr was requested with up to its usable size
+   */
+  void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size);
+
   /**
    * Changes the size of the memory block pointed to by ptr.
    * The function may move the memory block to a new location
@@ -153,7 +462,25 @@ extern "C"
   void buddy_init(struct buddy_pool *pool, size_t size);
 
   /**
-   * Inverse of buddy_init.
+   * Initialize a child memory pool that runs inside a single block of a parent
+   * pool instead of its own mapping. The block is allocated from the parent
+   * when the child is created and handed back to the parent, where it can
+   * coalesce, when the child is destroyed with buddy_destroy. The size is
+   * rounded and limited the same way as buddy_init. The parent's buddy_stats
+   * count the whole block as requested, not as internal fragmentation.
+   *
+   * NOTE: The parent must outlive the child. Destroying the parent while a
+   * child still exists results in undefined behavior.
+   *
+   * @param parent The pool to take the child memory from
+   * @param child A pointer to the pool to initialize
+   * @param size The size of the child pool in bytes
+   * @return 0 on success, -1 with errno set to EINVAL or ENOMEM on failure
+   */
+  int buddy_init_child(struct buddy_pool *parent, struct buddy_pool *child, size_t size);
+
+  /**
+   * Inverse of buddy_init and buddy_init_child.
    *
    * Notice that this function does not change the value of pool itself,
    * hence it still points to the same (now invalid) location.
@@ -162,6 +489,307 @@ extern "C"
    */
   void buddy_destroy(struct buddy_pool *pool);
 
+  /**
+   * Select the placement policy of a pool. BUDDY_POLICY_LIFO, the default,
+   * hands out the most recently freed block, which over time scatters live
+   * data across the whole pool. BUDDY_POLICY_ADDRESS hands out the lowest
+   * addressed free block of each order instead, so live data packs toward
+   * base and the top of the pool stays untouched. BUDDY_POLICY_SEGREGATED
+   * places requests below the segregation order (BUDDY_SEG_K unless set with
+   * buddy_set_segregated) in the lowest addressed free block that fits, and
+   * larger requests in the highest addressed one, split keeping the upper
+   * half. Small long lived objects then do not break up the space large
+   * blocks are formed from.
+   * The address policies are backed by a per order bitmap index of the free
+   * blocks that is built on first use and kept until the pool is destroyed.
+   *
+   * @param pool The memory pool
+   * @param policy One of the BUDDY_POLICY values
+   * @return 0 on success, -1 with errno set to EINVAL or ENOMEM on failure
+   */
+  int buddy_set_policy(struct buddy_pool *pool, int policy);
+
+  /**
+   * Select BUDDY_POLICY_SEGREGATED with the given segregation order. Blocks
+   * of order or larger come from the top of the pool, smaller ones from the
+   * bottom.
+   *
+   * @param pool The memory pool
+   * @param order The kval from which blocks are placed at the top
+   * @return 0 on success, -1 with errno set to EINVAL or ENOMEM on failure
+   */
+  int buddy_set_segregated(struct buddy_pool *pool, size_t order);
+
+  /**
+   * Turn lazy coalescing on or off. With lazy coalescing a freed block is
+   * parked at its order instead of being merged with its buddy, and the next
+   * request for that order reuses it without splitting. Once an order holds
+   * more than threshold parked blocks the order is coalesced. This stops an
+   * alloc/free loop on a fresh pool from splitting and merging all the way
+   * up and down on every iteration.
+   *
+   * Parked blocks are still owned by the pool: a request that can not be
+   * met coalesces everything before failing. Under an address placement
+   * policy a parked block is reused only when the policy would pick it over
+   * every free block of its order, the one nearest the policy's end of the
+   * pool first. A threshold of 0 turns lazy
+   * coalescing off and coalesces everything.
+   *
+   * @param pool The memory pool
+   * @param threshold The number of blocks each order may park
+   */
+  void buddy_set_lazy(struct buddy_pool *pool, size_t threshold);
+
+  /**
+   * Turn cache coloring on or off. Every block of order k starts at a
+   * multiple of 2^k from base, so without coloring the user data of all
+   * large blocks shares its low address bits and maps to the same cache
+   * sets. With coloring the user data of each block of order BUDDY_COLOR_K
+   * or larger starts a rotating number of BUDDY_COLOR_LINE byte lines into
+   * the block, cycling through colors offsets, as far as the slack between
+   * the requested size and the block size allows.
+   *
+   * Colored pointers are freed and reallocated like any other. Only blocks
+   * allocated while coloring is on are colored.
+   *
+   * @param pool The memory pool
+   * @param colors The number of offsets to rotate through, 0 or 1 turns coloring off
+   */
+  void buddy_set_colors(struct buddy_pool *pool, size_t colors);
+
+  /**
+   * Force full coalescing of every lazily freed block in the pool.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_coalesce(struct buddy_pool *pool);
+
+  /**
+   * Set how many pre-split blocks of the given order real-time mode keeps
+   * in reserve. The reserve lives on the lazy list of the order.
+   *
+   * @param pool The memory pool
+   * @param order The kval of the blocks, requests of up to 2^order minus the header size
+   * @param count The number of blocks to keep in reserve
+   */
+  void buddy_rt_reserve(struct buddy_pool *pool, size_t order, size_t count);
+
+  /**
+   * Turn on bounded latency (real-time) mode. A background thread keeps the
+   * reserve of each order set with buddy_rt_reserve topped up by splitting
+   * and coalesces blocks freed beyond twice the reserve. While the mode is on,
+   * buddy_malloc of a reserved order pops a parked block and buddy_free parks
+   * the block at its order, so neither does more than one list operation
+   * unless the reserve has run dry. buddy_malloc, buddy_free and buddy_realloc
+   * take the pool lock while the mode is on, other calls on the pool must not
+   * run concurrently with them.
+   *
+   * @param pool The memory pool
+   * @param interval_us How long the refill thread sleeps when reserves are full
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_rt_start(struct buddy_pool *pool, unsigned int interval_us);
+
+  /**
+   * Turn off real-time mode, join the refill thread and coalesce every
+   * parked block. buddy_destroy does this if the mode is still on.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_rt_stop(struct buddy_pool *pool);
+
+  /**
+   * Turn on the small object front end for a pool. Requests of up to
+   * BUDDY_SLAB_MAX bytes are then served from 16 byte granular size classes
+   * carved out of 2^BUDDY_SLAB_K byte blocks (slabs) whenever that wastes less
+   * memory than a buddy block would. Routing is transparent: pointers from
+   * slabs are passed to buddy_free and buddy_realloc like any other, and a
+   * slab goes back to the pool as soon as its last object is freed.
+   *
+   * Slab objects are 16 byte aligned, or 8 byte aligned in learned classes.
+   * The front end stays on until the pool is destroyed.
+   *
+   * @param pool The memory pool
+   * @return 0 on success, -1 with errno set to EINVAL or ENOMEM on failure
+   */
+  int buddy_slab_enable(struct buddy_pool *pool);
+
+  /**
+   * Open a profiling window on the small object front end, turning the front
+   * end on if needed. The next window requests of up to BUDDY_SLAB_MAX bytes
+   * are sampled at 8 byte granularity. When the window closes, up to top_k of
+   * the hottest sizes that would waste less memory in a class of their own
+   * get a dedicated class, until BUDDY_SLAB_LEARNED classes are in use.
+   * Learned classes are at least 16 bytes, smaller requests keep using the
+   * 16 byte class. New
+   * requests of those sizes use the new class right away while objects
+   * already handed out drain out of their old slabs as they are freed.
+   *
+   * @param pool The memory pool
+   * @param window The number of requests to sample
+   * @param top_k The most classes to learn from this window
+   * @return 0 on success, -1 with errno set to EINVAL or ENOMEM on failure
+   */
+  int buddy_slab_profile(struct buddy_pool *pool, size_t window, size_t top_k);
+
+  /**
+   * Report what profiling has learned and the internal fragmentation the
+   * learned classes have saved. A pool without the front end reports zeros.
+   *
+   * @param pool The memory pool
+   * @param out Filled in with the report
+   */
+  void buddy_slab_report(struct buddy_pool *pool, struct buddy_slab_report *out);
+
+  /**
+   * Create a bump pointer arena that takes chunks of 2^chunk_order bytes from
+   * pool. The arena grows by pulling additional chunks from the pool as
+   * needed. Requests that do not fit in a regular chunk get a dedicated chunk
+   * of their own.
+   *
+   * If pool is NULL or chunk_order is larger than the pool, the return value
+   * will be NULL and errno is set to EINVAL. If the pool can not supply the
+   * first chunk the return value will be NULL and errno is set to ENOMEM.
+   *
+   * @param pool The memory pool to take chunks from
+   * @param chunk_order The kval of each chunk, raised to a workable minimum if needed
+   * @return A pointer to the new arena
+   */
+  struct buddy_arena *buddy_arena_create(struct buddy_pool *pool, size_t chunk_order);
+
+  /**
+   * Allocates size bytes from the arena aligned to align bytes. Memory from
+   * an arena can not be passed to buddy_free or buddy_realloc, it is only
+   * released by buddy_arena_destroy.
+   *
+   * If size is zero or align is not a power of two, the return value will be NULL
+   *
+   * @param arena The arena to allocate from
+   * @param size The number of bytes needed
+   * @param align The alignment of the returned pointer, 0 for the default alignment
+   * @return A pointer to the memory or NULL if the pool is out of memory
+   */
+  void *buddy_arena_alloc(struct buddy_arena *arena, size_t size, size_t align);
+
+  /**
+   * Return every chunk held by the arena to its pool, releasing all memory
+   * handed out by the arena including the arena itself.
+   *
+   * @param arena The arena to destroy
+   */
+  void buddy_arena_destroy(struct buddy_arena *arena);
+
+  /**
+   * Configure the process wide mapping cache. When a pool is destroyed its
+   * mapping is parked in the cache (up to max_entries mappings) instead of
+   * being unmapped, and the next buddy_init of the same order reuses it. This
+   * saves the mmap/munmap calls and, with BUDDY_CACHE_KEEP, the page faults
+   * needed to repopulate the memory. With BUDDY_CACHE_DONTNEED the pages are
+   * handed back to the kernel and read as zero when they are touched again.
+   *
+   * The cache is disabled until this is called. Lowering max_entries unmaps
+   * any mappings above the new limit. A value of 0 disables the cache. Values
+   * larger than BUDDY_CACHE_MAX are clamped.
+   *
+   * @param max_entries The number of mappings the cache may hold
+   * @param scrub BUDDY_CACHE_KEEP or BUDDY_CACHE_DONTNEED
+   */
+  void buddy_cache_config(size_t max_entries, int scrub);
+
+  /**
+   * Unmap every mapping held in the mapping cache.
+   *
+   * @return The number of mappings that were released
+   */
+  size_t buddy_cache_flush(void);
+
+  /**
+   * Copy the counters of a pool. Everything is maintained as the pool is
+   * used, so this costs one pass over the orders and never walks the heap.
+   * Internal fragmentation is reserved less requested. last holds the
+   * work of the most recent allocating or freeing call, which outside of
+   * real-time mode does not depend on timing or the machine.
+   *
+   * @param pool The memory pool
+   * @param out Filled in with the counters
+   * @return 0 on success, -1 with errno set to EINVAL on failure
+   */
+  int buddy_stats(struct buddy_pool *pool, struct buddy_stats *out);
+
+  /**
+   * Start recording every malloc, free and realloc call on the pool to a
+   * ring buffer trace file at path, see struct buddy_trace_header for the
+   * format. The file is created or truncated and mapped shared, records are
+   * written straight into the mapping, so the trace survives a crash of the
+   * process. Each call costs a timestamp, an atomic increment and a 40 byte
+   * store. An existing trace of the pool is stopped first.
+   *
+   * @param pool The memory pool to trace
+   * @param path The trace file
+   * @param records The number of records the ring holds
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_trace_start(struct buddy_pool *pool, const char *path, size_t records);
+
+  /**
+   * Stop tracing and unmap the trace file, leaving it on disk. Also done
+   * by buddy_destroy.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_trace_stop(struct buddy_pool *pool);
+
+  /**
+   * Heap profiler defaults. BUDDY_PROFILE_RATE is the mean number of bytes
+   * allocated between two samples and BUDDY_PROFILE_DEPTH the most stack
+   * frames kept per sample.
+   */
+#define BUDDY_PROFILE_RATE (512 * 1024)
+#define BUDDY_PROFILE_DEPTH 32
+
+  /**
+   * Start sampling heap profiling. Allocations are sampled about once every
+   * rate bytes, with the gap to the next sample drawn from an exponential
+   * distribution so every byte is equally likely to be picked. A sampled
+   * allocation records a stack walked through the frame pointers, so code
+   * must be built with -fno-omit-frame-pointer for deep stacks, and stays
+   * in the profile until it is freed. Unsampled calls cost a subtraction.
+   * An existing profile of the pool is stopped first.
+   *
+   * @param pool The memory pool to profile
+   * @param rate Mean bytes between samples, 0 for BUDDY_PROFILE_RATE
+   * @param path Where buddy_destroy dumps the profile, NULL for no dump
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_profile_start(struct buddy_pool *pool, size_t rate, const char *path);
+
+  /**
+   * Write the sampled live blocks as a gperftools heap profile, the legacy
+   * text format pprof reads, with the process memory map appended so pprof
+   * can symbolize the stacks.
+   *
+   * @param pool The memory pool
+   * @param path The file to write, NULL for the path given to buddy_profile_start
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int buddy_profile_dump(struct buddy_pool *pool, const char *path);
+
+  /**
+   * Stop profiling and drop the samples without dumping them. buddy_destroy
+   * dumps to the path given to buddy_profile_start and then stops.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_profile_stop(struct buddy_pool *pool);
+
+  /**
+   * The smallest tick count that falls in a latency histogram bucket.
+   *
+   * @param bucket A bucket below BUDDY_HIST_BUCKETS
+   * @return The lower bound of the bucket in ticks
+   */
+  uint64_t buddy_hist_floor(size_t bucket);
+
   /**
    * @brief Entry to a main function for testing purposes
    *
@@ -1,6 +1,9 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <time.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
@@ -490,6 +493,998 @@ void test_buddy_edge_cases(void)
     buddy_destroy(&pool);
 }
 
+void test_buddy_mapping_cache(void)
+{
+    fprintf(stderr, "->Testing mapping cache reuse and flush\n");
+    struct buddy_pool pool;
+    size_t pool_size = UINT64_C(1) << MIN_K;
+
+    //The cache is opt in, by default destroy unmaps
+    buddy_init(&pool, pool_size);
+    buddy_destroy(&pool);
+    TEST_ASSERT_EQUAL(0, buddy_cache_flush());
+
+    buddy_cache_config(BUDDY_CACHE_DEFAULT, BUDDY_CACHE_KEEP);
+    buddy_init(&pool, pool_size);
+    void *base = pool.base;
+    char *mem = buddy_malloc(&pool, 64);
+    assert(mem != NULL);
+    buddy_destroy(&pool);
+
+    //Same order should get the cached mapping back as a full pool
+    buddy_init(&pool, pool_size);
+    assert(pool.base == base);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+
+    //A different order must not reuse the mapping
+    buddy_init(&pool, pool_size * 2);
+    assert(pool.base != base);
+    buddy_destroy(&pool);
+
+    TEST_ASSERT_EQUAL(2, buddy_cache_flush());
+    TEST_ASSERT_EQUAL(0, buddy_cache_flush());
+
+    //With the cache disabled destroy unmaps right away
+    buddy_cache_config(0, BUDDY_CACHE_KEEP);
+    buddy_init(&pool, pool_size);
+    buddy_destroy(&pool);
+    TEST_ASSERT_EQUAL(0, buddy_cache_flush());
+
+    //Dontneed scrubbing hands back zero filled pages
+    buddy_cache_config(BUDDY_CACHE_DEFAULT, BUDDY_CACHE_DONTNEED);
+    buddy_init(&pool, pool_size);
+    mem = buddy_malloc(&pool, 64);
+    memset(mem, 0xff, 64);
+    buddy_destroy(&pool);
+    buddy_init(&pool, pool_size);
+    mem = buddy_malloc(&pool, 64);
+    assert(mem[0] == 0 && mem[63] == 0);
+    buddy_destroy(&pool);
+
+    buddy_cache_flush();
+    buddy_cache_config(0, BUDDY_CACHE_KEEP);
+}
+
+void test_buddy_arena(void)
+{
+    fprintf(stderr, "->Testing bump pointer arenas\n");
+    struct buddy_pool pool;
+    size_t pool_size = UINT64_C(1) << MIN_K;
+    buddy_init(&pool, pool_size);
+
+    assert(buddy_arena_create(NULL, 12) == NULL);
+    assert(buddy_arena_create(&pool, MIN_K + 1) == NULL);
+    assert(errno == EINVAL);
+
+    struct buddy_arena *arena = buddy_arena_create(&pool, 12);
+    assert(arena != NULL);
+    assert(buddy_arena_alloc(arena, 0, 0) == NULL);
+    assert(buddy_arena_alloc(arena, 8, 3) == NULL);
+
+    //Enough small objects to pull in several chunks
+    unsigned char *objs[500];
+    for (size_t i = 0; i < 500; i++) {
+        size_t align = (size_t)1 << (i % 7);
+        objs[i] = buddy_arena_alloc(arena, 1 + i % 40, align);
+        assert(objs[i] != NULL);
+        assert(((uintptr_t)objs[i] & (align - 1)) == 0);
+        memset(objs[i], (int)i, 1 + i % 40);
+    }
+    //A request bigger than a chunk gets its own chunk
+    unsigned char *big = buddy_arena_alloc(arena, 10000, 256);
+    assert(big != NULL);
+    assert(((uintptr_t)big & 255) == 0);
+    memset(big, 0xab, 10000);
+    //and the arena keeps bumping in the current chunk afterwards
+    unsigned char *after = buddy_arena_alloc(arena, 16, 0);
+    assert(after == objs[499] + 32);
+
+    for (size_t i = 0; i < 500; i++) {
+        assert(objs[i][0] == (unsigned char)i);
+        assert(objs[i][i % 40] == (unsigned char)i);
+    }
+
+    buddy_arena_destroy(arena);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_child_pools(void)
+{
+    fprintf(stderr, "->Testing child pools backed by a parent block\n");
+    struct buddy_pool parent;
+    buddy_init(&parent, UINT64_C(1) << (MIN_K + 2));
+
+    assert(buddy_init_child(NULL, &parent, 0) == -1);
+    assert(errno == EINVAL);
+
+    //A parent of 4x MIN_K fits exactly four minimum sized children
+    struct buddy_pool kids[5];
+    for (int i = 0; i < 4; i++) {
+        assert(buddy_init_child(&parent, &kids[i], 1) == 0);
+        assert(kids[i].kval_m == MIN_K);
+        assert(kids[i].parent == &parent);
+        assert((char *)kids[i].base >= (char *)parent.base);
+        assert((char *)kids[i].base < (char *)parent.base + parent.numbytes);
+        //The free top block of a child stays tagged reserved for the parent
+        assert(kids[i].avail[MIN_K].next == kids[i].base);
+        assert(kids[i].avail[MIN_K].next->tag == BLOCK_RESERVED);
+    }
+    assert(buddy_init_child(&parent, &kids[4], 1) == -1);
+    assert(errno == ENOMEM);
+    check_buddy_pool_empty(&parent);
+
+    //The children use their whole blocks, the parent has no internal fragmentation
+    struct buddy_stats st;
+    buddy_stats(&parent, &st);
+    assert(st.reserved == parent.numbytes);
+    assert(st.requested == st.reserved);
+
+    //Allocations stay inside the child block
+    char *mem = buddy_malloc(&kids[2], 1000);
+    assert(mem >= (char *)kids[2].base);
+    assert(mem + 1000 <= (char *)kids[2].base + kids[2].numbytes);
+    buddy_free(&kids[2], mem);
+    assert(kids[2].avail[MIN_K].next == kids[2].base);
+    assert(kids[2].avail[MIN_K].next->tag == BLOCK_RESERVED);
+
+    //Destroying the children coalesces the parent back to one block
+    for (int i = 3; i >= 0; i--) {
+        buddy_destroy(&kids[i]);
+    }
+    check_buddy_pool_full(&parent);
+    buddy_stats(&parent, &st);
+    assert(st.reserved == 0);
+    assert(st.requested == 0);
+    buddy_destroy(&parent);
+}
+
+void test_buddy_slab(void)
+{
+    fprintf(stderr, "->Testing slab front end for small objects\n");
+    struct buddy_pool pool;
+    size_t pool_size = UINT64_C(1) << (MIN_K + 3);
+    buddy_init(&pool, pool_size);
+    assert(buddy_slab_enable(NULL) == -1);
+    assert(buddy_slab_enable(&pool) == 0);
+    assert(buddy_slab_enable(&pool) == 0);
+
+    //A 40 byte object lands in the 48 byte class instead of a 64 byte block
+    char *a = buddy_malloc(&pool, 40);
+    char *b = buddy_malloc(&pool, 40);
+    assert(b - a == 48);
+    assert(((uintptr_t)a & 15) == 0);
+
+    //Realloc stays in place inside the class and moves with the data beyond it
+    memset(a, 0x5a, 40);
+    assert(buddy_realloc(&pool, a, 48) == a);
+    char *c = buddy_realloc(&pool, a, 300);
+    assert(c != a);
+    assert(c[0] == 0x5a && c[39] == 0x5a);
+    buddy_free(&pool, b);
+    buddy_free(&pool, c);
+    check_buddy_pool_full(&pool);
+
+    //Fill many slabs of every class and hand them all back
+    static unsigned char *objs[4000];
+    for (size_t i = 0; i < 4000; i++) {
+        size_t size = 1 + (i * 37) % BUDDY_SLAB_MAX;
+        objs[i] = buddy_malloc(&pool, size);
+        assert(objs[i] != NULL);
+        memset(objs[i], (int)i, size);
+    }
+    for (size_t i = 0; i < 4000; i++) {
+        size_t size = 1 + (i * 37) % BUDDY_SLAB_MAX;
+        assert(objs[i][0] == (unsigned char)i && objs[i][size - 1] == (unsigned char)i);
+    }
+    for (size_t i = 0; i < 4000; i += 2) {
+        buddy_free(&pool, objs[i]);
+    }
+    for (size_t i = 1; i < 4000; i += 2) {
+        buddy_free(&pool, objs[i]);
+    }
+    check_buddy_pool_full(&pool);
+
+    //Large requests still get a buddy block with a header
+    void *big = buddy_malloc(&pool, 5000);
+    struct avail *tmp = (struct avail *)big - 1;
+    assert(tmp->tag == BLOCK_RESERVED);
+    assert(tmp->kval == 13);
+    buddy_free(&pool, big);
+
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_slab_profile(void)
+{
+    fprintf(stderr, "->Testing adaptive size classes on a skewed workload\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << (MIN_K + 3));
+    assert(buddy_slab_profile(&pool, 0, 3) == -1);
+    assert(buddy_slab_profile(&pool, 1000, 3) == 0);
+
+    //Mostly three hot odd sizes with a trickle of everything else
+    static const size_t hot[] = {72, 136, 200};
+    static void *objs[3000];
+    for (size_t i = 0; i < 3000; i++) {
+        size_t size = (i % 10 == 9) ? 1 + (size_t)rand() % 512 : hot[i % 3];
+        objs[i] = buddy_malloc(&pool, size);
+        assert(objs[i] != NULL);
+        memset(objs[i], 0x11, size);
+    }
+
+    struct buddy_slab_report report;
+    buddy_slab_report(&pool, &report);
+    TEST_ASSERT_EQUAL(1000, report.samples);
+    assert(!report.profiling);
+    TEST_ASSERT_EQUAL(3, report.learned);
+    for (size_t i = 0; i < 3; i++) {
+        assert(report.size[i] == 72 || report.size[i] == 136 || report.size[i] == 200);
+        assert(report.replaces[i] == report.size[i] + 8);
+        assert(report.allocs[i] > 0);
+    }
+    assert(report.saved_bytes > 0);
+    assert(report.live_saved_bytes == report.saved_bytes);
+
+    //Hot sizes now pack back to back at their exact size
+    char *a = buddy_malloc(&pool, 72);
+    char *b = buddy_malloc(&pool, 72);
+    assert(b - a == 72);
+    buddy_free(&pool, a);
+    buddy_free(&pool, b);
+
+    for (size_t i = 0; i < 3000; i++) {
+        buddy_free(&pool, objs[i]);
+    }
+    buddy_slab_report(&pool, &report);
+    TEST_ASSERT_EQUAL(0, report.live_saved_bytes);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_slab_profile_tiny(void)
+{
+    fprintf(stderr, "->Testing adaptive size classes on tiny requests\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    assert(buddy_slab_enable(&pool) == 0);
+    assert(buddy_slab_profile(&pool, 100, 1) == 0);
+
+    //An 8 byte class would have more objects than a slab bitmap holds, so
+    //profiling only 8 byte requests must not learn one
+    static void *objs[600];
+    for (size_t i = 0; i < 600; i++) {
+        objs[i] = buddy_malloc(&pool, 8);
+        assert(objs[i] != NULL);
+        memset(objs[i], (int)i, 8);
+    }
+    struct buddy_slab_report report;
+    buddy_slab_report(&pool, &report);
+    assert(!report.profiling);
+    for (size_t i = 0; i < report.learned; i++) {
+        assert(report.size[i] >= 16);
+    }
+
+    //600 live objects span more than one slab without overlapping
+    for (size_t i = 0; i < 600; i++) {
+        for (size_t j = 0; j < 8; j++) {
+            TEST_ASSERT_EQUAL((unsigned char)i, ((unsigned char *)objs[i])[j]);
+        }
+    }
+    for (size_t i = 0; i < 600; i++) {
+        buddy_free(&pool, objs[i]);
+    }
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_lazy_coalescing(void)
+{
+    fprintf(stderr, "->Testing lazy coalescing\n");
+    struct buddy_pool pool;
+    size_t pool_size = UINT64_C(1) << MIN_K;
+    buddy_init(&pool, pool_size);
+    buddy_set_lazy(&pool, 2);
+
+    //Ping-pong reuses the parked block without touching the avail lists
+    void *mem = buddy_malloc(&pool, 1);
+    buddy_free(&pool, mem);
+    TEST_ASSERT_EQUAL(1, pool.lazy_count[SMALLEST_K]);
+    assert(pool.lazy[SMALLEST_K].next == (struct avail *)mem - 1);
+    assert(pool.avail[pool.kval_m].next == &pool.avail[pool.kval_m]);
+    for (int i = 0; i < 10; i++) {
+        void *again = buddy_malloc(&pool, 1);
+        assert(again == mem);
+        buddy_free(&pool, again);
+    }
+    buddy_coalesce(&pool);
+    TEST_ASSERT_EQUAL(0, pool.lazy_count[SMALLEST_K]);
+    check_buddy_pool_full(&pool);
+
+    //Going over the threshold coalesces the whole order
+    void *blocks[4];
+    for (int i = 0; i < 4; i++) {
+        blocks[i] = buddy_malloc(&pool, 1);
+    }
+    buddy_free(&pool, blocks[0]);
+    buddy_free(&pool, blocks[1]);
+    TEST_ASSERT_EQUAL(2, pool.lazy_count[SMALLEST_K]);
+    buddy_free(&pool, blocks[2]);
+    TEST_ASSERT_EQUAL(0, pool.lazy_count[SMALLEST_K]);
+    buddy_free(&pool, blocks[3]);
+    TEST_ASSERT_EQUAL(1, pool.lazy_count[SMALLEST_K]);
+    buddy_set_lazy(&pool, 0);
+    check_buddy_pool_full(&pool);
+
+    //Parked blocks are coalesced before a request fails
+    buddy_set_lazy(&pool, SIZE_MAX);
+    void *small[16];
+    for (int i = 0; i < 16; i++) {
+        small[i] = buddy_malloc(&pool, 1);
+    }
+    for (int i = 0; i < 16; i++) {
+        buddy_free(&pool, small[i]);
+    }
+    void *whole = buddy_malloc(&pool, pool_size - sizeof(struct avail));
+    assert(whole != NULL);
+    buddy_free(&pool, whole);
+    buddy_coalesce(&pool);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_rt_mode(void)
+{
+    fprintf(stderr, "->Testing real-time mode reserves\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    buddy_rt_reserve(&pool, SMALLEST_K, 8);
+    buddy_rt_reserve(&pool, 10, 4);
+    assert(buddy_rt_start(&pool, 100) == 0);
+
+    //Wait for the refill thread to fill the reserves
+    for (int i = 0; i < 1000; i++) {
+        pthread_mutex_lock(&pool.lock);
+        bool full = pool.lazy_count[SMALLEST_K] == 8 && pool.lazy_count[10] == 4;
+        pthread_mutex_unlock(&pool.lock);
+        if (full) {
+            break;
+        }
+        usleep(1000);
+    }
+    pthread_mutex_lock(&pool.lock);
+    TEST_ASSERT_EQUAL(8, pool.lazy_count[SMALLEST_K]);
+    TEST_ASSERT_EQUAL(4, pool.lazy_count[10]);
+    struct avail *reserved = pool.lazy[SMALLEST_K].next;
+    pthread_mutex_unlock(&pool.lock);
+
+    //The hot path pops the parked block and frees park it again
+    void *mem = buddy_malloc(&pool, 1);
+    assert(mem == reserved + 1);
+    void *blocks[32];
+    for (int i = 0; i < 32; i++) {
+        blocks[i] = buddy_malloc(&pool, 900);
+        assert(blocks[i] != NULL);
+    }
+    for (int i = 0; i < 32; i++) {
+        buddy_free(&pool, blocks[i]);
+    }
+    buddy_free(&pool, mem);
+
+    //Stopping coalesces everything back
+    buddy_rt_stop(&pool);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_address_policy(void)
+{
+    fprintf(stderr, "->Testing address ordered placement\n");
+    struct buddy_pool pool;
+    size_t pool_size = UINT64_C(1) << MIN_K;
+    buddy_init(&pool, pool_size);
+    assert(buddy_set_policy(&pool, 7) == -1);
+    assert(errno == EINVAL);
+
+    //Build some history under LIFO before switching so the index has to
+    //pick up existing free blocks
+    void *blocks[64];
+    for (int i = 0; i < 64; i++) {
+        blocks[i] = buddy_malloc(&pool, 1);
+    }
+    buddy_free(&pool, blocks[10]);
+    buddy_free(&pool, blocks[40]);
+    assert(buddy_malloc(&pool, 1) == blocks[40]);
+    buddy_free(&pool, blocks[40]);
+
+    assert(buddy_set_policy(&pool, BUDDY_POLICY_ADDRESS) == 0);
+    assert(buddy_malloc(&pool, 1) == blocks[10]);
+    assert(buddy_malloc(&pool, 1) == blocks[40]);
+
+    //Frees in any order still hand back the lowest block first
+    buddy_free(&pool, blocks[50]);
+    buddy_free(&pool, blocks[20]);
+    buddy_free(&pool, blocks[30]);
+    assert(buddy_malloc(&pool, 1) == blocks[20]);
+    assert(buddy_malloc(&pool, 1) == blocks[30]);
+    assert(buddy_malloc(&pool, 1) == blocks[50]);
+
+    //Parked blocks are placed the same way instead of coming back LIFO
+    buddy_set_lazy(&pool, 4);
+    buddy_free(&pool, blocks[20]);
+    buddy_free(&pool, blocks[50]);
+    assert(buddy_malloc(&pool, 1) == blocks[20]);
+    assert(buddy_malloc(&pool, 1) == blocks[50]);
+    buddy_set_lazy(&pool, 0);
+
+    //Bigger requests come from the lowest free block that fits
+    char *big = buddy_malloc(&pool, 1000);
+    assert(big > (char *)blocks[63]);
+    assert(big < (char *)blocks[63] + 2048);
+
+    buddy_free(&pool, big);
+    for (int i = 0; i < 64; i++) {
+        buddy_free(&pool, blocks[i]);
+    }
+    check_buddy_pool_full(&pool);
+
+    //A random workload keeps the index and the lists in step
+    void *live[200] = {0};
+    for (int i = 0; i < 5000; i++) {
+        int slot = rand() % 200;
+        if (live[slot]) {
+            buddy_free(&pool, live[slot]);
+            live[slot] = NULL;
+        } else {
+            live[slot] = buddy_malloc(&pool, 1 + (size_t)rand() % 4000);
+        }
+    }
+    for (int i = 0; i < 200; i++) {
+        buddy_free(&pool, live[i]);
+    }
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_segregated_policy(void)
+{
+    fprintf(stderr, "->Testing size segregated placement\n");
+    struct buddy_pool pool;
+    size_t pool_size = UINT64_C(1) << MIN_K;
+    buddy_init(&pool, pool_size);
+    assert(buddy_set_segregated(&pool, MIN_K + 1) == -1);
+    assert(buddy_set_segregated(&pool, 12) == 0);
+    TEST_ASSERT_EQUAL(BUDDY_POLICY_SEGREGATED, pool.policy);
+
+    //Small requests from the bottom, large ones from the top
+    char *small = buddy_malloc(&pool, 100);
+    assert(small == (char *)pool.base + sizeof(struct avail));
+    char *large = buddy_malloc(&pool, 4000);
+    assert(large == (char *)pool.base + pool_size - 4096 + sizeof(struct avail));
+    char *larger = buddy_malloc(&pool, 20000);
+    assert(larger == (char *)pool.base + pool_size - 65536 + sizeof(struct avail));
+    char *small2 = buddy_malloc(&pool, 100);
+    assert(small2 == small + 128);
+
+    buddy_free(&pool, large);
+    buddy_free(&pool, small);
+    buddy_free(&pool, larger);
+    buddy_free(&pool, small2);
+    check_buddy_pool_full(&pool);
+
+    void *live[200] = {0};
+    for (int i = 0; i < 5000; i++) {
+        int slot = rand() % 200;
+        if (live[slot]) {
+            buddy_free(&pool, live[slot]);
+            live[slot] = NULL;
+        } else {
+            live[slot] = buddy_malloc(&pool, 1 + (size_t)rand() % 8000);
+        }
+    }
+    for (int i = 0; i < 200; i++) {
+        buddy_free(&pool, live[i]);
+    }
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_lifetime_hints(void)
+{
+    fprintf(stderr, "->Testing lifetime hints\n");
+    struct buddy_pool pool;
+    size_t pool_size = UINT64_C(1) << MIN_K;
+    buddy_init(&pool, pool_size);
+
+    //Long lived from the bottom, short lived from the top
+    char *l1 = buddy_malloc_hint(&pool, 100, BUDDY_HINT_LONG);
+    assert(l1 == (char *)pool.base + sizeof(struct avail));
+    char *s1 = buddy_malloc_hint(&pool, 4000, BUDDY_HINT_SHORT);
+    assert(s1 == (char *)pool.base + pool_size - 4096 + sizeof(struct avail));
+    char *s2 = buddy_malloc_hint(&pool, 100, BUDDY_HINT_SHORT);
+    assert(s2 == (char *)pool.base + pool_size - 4096 - 128 + sizeof(struct avail));
+    char *l2 = buddy_malloc_hint(&pool, 4000, BUDDY_HINT_LONG);
+    assert(l2 == (char *)pool.base + 4096 + sizeof(struct avail));
+    memset(s1, 1, 4000);
+    memset(l2, 2, 4000);
+
+    //No hint is plain buddy_malloc
+    char *plain = buddy_malloc_hint(&pool, 100, 0);
+    assert(plain != NULL);
+    buddy_free(&pool, plain);
+
+    assert(buddy_malloc_hint(&pool, pool_size, BUDDY_HINT_SHORT) == NULL);
+    TEST_ASSERT_EQUAL(ENOMEM, errno);
+
+    buddy_free(&pool, s1);
+    buddy_free(&pool, l1);
+    buddy_free(&pool, s2);
+    buddy_free(&pool, l2);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_malloc_near(void)
+{
+    fprintf(stderr, "->Testing allocation near a hint\n");
+    struct buddy_pool pool;
+    size_t pool_size = UINT64_C(1) << MIN_K;
+    buddy_init(&pool, pool_size);
+    char *base = (char *)pool.base + sizeof(struct avail);
+
+    char *first = buddy_malloc(&pool, 40);
+    assert(first == base);
+    char *big = buddy_malloc(&pool, 5000);
+    assert(big == base + 8192);
+    char *far = buddy_malloc(&pool, 40000);
+    assert(far == base + 65536);
+
+    //The buddy of the hint is the closest block there is
+    char *next = buddy_malloc_near(&pool, 40, first);
+    assert(next == base + 64);
+    //Next to the big block, in the subtree it shares with its buddy
+    char *beside = buddy_malloc_near(&pool, 100, big + 100);
+    assert(beside >= base && beside < base + 8192);
+    assert(beside == base + 128);
+    //A 64K block has nothing within BUDDY_NEAR_K of it, so this is buddy_malloc
+    char *after = buddy_malloc_near(&pool, 100, far);
+    assert(after == base + 256);
+
+    //Hints outside the pool fall back to buddy_malloc
+    char *plain = buddy_malloc_near(&pool, 40, &pool);
+    assert(plain != NULL);
+
+    buddy_free(&pool, next);
+    buddy_free(&pool, plain);
+    buddy_free(&pool, far);
+    buddy_free(&pool, beside);
+    buddy_free(&pool, after);
+    buddy_free(&pool, big);
+    buddy_free(&pool, first);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_colors(void)
+{
+    fprintf(stderr, "->Testing cache coloring\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    buddy_set_colors(&pool, 4);
+
+    //Every large block starts one more line in, wrapping after four
+    char *big[6];
+    for (int i = 0; i < 6; i++) {
+        big[i] = buddy_malloc(&pool, 10000);
+        size_t offset = (size_t)(big[i] - (char *)pool.base) % 16384;
+        TEST_ASSERT_EQUAL(sizeof(struct avail) + (size_t)(i % 4) * BUDDY_COLOR_LINE, offset);
+        memset(big[i], i, 10000);
+    }
+    //Blocks without slack and small blocks are never colored
+    char *full = buddy_malloc(&pool, 16384 - sizeof(struct avail));
+    TEST_ASSERT_EQUAL(sizeof(struct avail), (size_t)(full - (char *)pool.base) % 16384);
+    char *small = buddy_malloc(&pool, 1000);
+    TEST_ASSERT_EQUAL(sizeof(struct avail), (size_t)(small - (char *)pool.base) % 1024);
+
+    //Reallocating a colored block keeps its data
+    char *grown = buddy_realloc(&pool, big[1], 20000);
+    assert(grown != NULL);
+    for (int i = 0; i < 10000; i++) {
+        assert(grown[i] == 1);
+    }
+    big[1] = grown;
+
+    for (int i = 0; i < 6; i++) {
+        buddy_free(&pool, big[i]);
+    }
+    buddy_free(&pool, full);
+    buddy_free(&pool, small);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_malloc_range(void)
+{
+    fprintf(stderr, "->Testing best effort sized allocation\n");
+    struct buddy_pool pool;
+    size_t pool_size = UINT64_C(1) << MIN_K;
+    buddy_init(&pool, pool_size);
+    size_t got = 0;
+
+    //A whole free pool gives the largest block within max
+    char *all = buddy_malloc_range(&pool, 4096, pool_size, &got);
+    TEST_ASSERT_EQUAL(pool_size - sizeof(struct avail), got);
+    buddy_free(&pool, all);
+    char *capped = buddy_malloc_range(&pool, 4096, 100000, &got);
+    TEST_ASSERT_EQUAL(65536 - sizeof(struct avail), got);
+    memset(capped, 1, got);
+    buddy_free(&pool, capped);
+
+    //With half the pool taken the other half is the best there is
+    char *half = buddy_malloc(&pool, pool_size / 4 + 1);
+    char *rest = buddy_malloc_range(&pool, 4096, pool_size, &got);
+    TEST_ASSERT_EQUAL(pool_size / 2 - sizeof(struct avail), got);
+    assert(buddy_malloc_range(&pool, 4096, pool_size, &got) == NULL);
+    TEST_ASSERT_EQUAL(ENOMEM, errno);
+    buddy_free(&pool, rest);
+
+    //The usable size never drops below min
+    char *small = buddy_malloc_range(&pool, 100, 100, &got);
+    TEST_ASSERT_EQUAL(128 - sizeof(struct avail), got);
+    assert(buddy_malloc_range(&pool, 200, 100, &got) == NULL);
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+
+    buddy_free(&pool, small);
+    buddy_free(&pool, half);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_usable_size(void)
+{
+    fprintf(stderr, "->Testing usable size\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    size_t usable = 0;
+
+    char *mem = buddy_malloc_usable(&pool, 100, &usable);
+    TEST_ASSERT_EQUAL(128 - sizeof(struct avail), usable);
+    TEST_ASSERT_EQUAL(usable, buddy_usable_size(&pool, mem));
+    memset(mem, 1, usable);
+    char *big = buddy_malloc(&pool, 5000);
+    TEST_ASSERT_EQUAL(8192 - sizeof(struct avail), buddy_usable_size(&pool, big));
+    TEST_ASSERT_EQUAL(0, buddy_usable_size(&pool, NULL));
+
+    //Colored blocks lose their offset, slab objects report their class
+    buddy_set_colors(&pool, 2);
+    char *first = buddy_malloc(&pool, 5000);
+    TEST_ASSERT_EQUAL(8192 - sizeof(struct avail), buddy_usable_size(&pool, first));
+    char *colored = buddy_malloc_usable(&pool, 5000, &usable);
+    TEST_ASSERT_EQUAL(8192 - sizeof(struct avail) - BUDDY_COLOR_LINE, usable);
+    buddy_slab_enable(&pool);
+    char *obj = buddy_malloc_usable(&pool, 20, &usable);
+    assert(usable >= 20 && usable < 128 - sizeof(struct avail));
+    TEST_ASSERT_EQUAL(usable, buddy_usable_size(&pool, obj));
+
+    buddy_free(&pool, obj);
+    buddy_free(&pool, colored);
+    buddy_free(&pool, first);
+    buddy_free(&pool, big);
+    buddy_free(&pool, mem);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_free_sized(void)
+{
+    fprintf(stderr, "->Testing sized free\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+    char *a = buddy_malloc(&pool, 100);
+    char *b = buddy_malloc(&pool, 5000);
+    size_t usable = 0;
+    char *c = buddy_malloc_usable(&pool, 3000, &usable);
+    buddy_set_colors(&pool, 4);
+    char *d = buddy_malloc(&pool, 5000);
+    char *e = buddy_malloc(&pool, 5000);
+    assert(buddy_usable_size(&pool, e) < 8192 - sizeof(struct avail));
+
+    //Any size from the request up to the usable size finds the block, and
+    //the requested bytes drop by the size passed in
+    struct buddy_stats st;
+    buddy_stats(&pool, &st);
+    size_t requested = st.requested;
+    buddy_free_sized(&pool, a, 100);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(requested - 100, st.requested);
+    buddy_free_sized(&pool, c, usable);
+    buddy_free_sized(&pool, e, 5000);
+    buddy_free_sized(&pool, b, 8000);
+    buddy_free_sized(&pool, d, 4200);
+    buddy_free_sized(&pool, NULL, 100);
+    check_buddy_pool_full(&pool);
+
+    //Slab objects go through the page map
+    buddy_slab_enable(&pool);
+    char *obj = buddy_malloc(&pool, 24);
+    buddy_free_sized(&pool, obj, 24);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_stats(void)
+{
+    fprintf(stderr, "->Testing pool statistics\n");
+    struct buddy_pool pool;
+    struct buddy_stats st;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    assert(buddy_stats(&pool, NULL) == -1);
+
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(1, st.free_blocks[MIN_K]);
+    TEST_ASSERT_EQUAL(MIN_K, st.largest_free);
+    TEST_ASSERT_EQUAL(0, st.reserved);
+
+    char *a = buddy_malloc(&pool, 100);
+    char *b = buddy_malloc(&pool, 5000);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(MIN_K - 7, st.cost.splits);
+    TEST_ASSERT_EQUAL(1, st.used_blocks[7]);
+    TEST_ASSERT_EQUAL(1, st.used_blocks[13]);
+    TEST_ASSERT_EQUAL(0, st.free_blocks[13]);
+    TEST_ASSERT_EQUAL(1, st.free_blocks[12]);
+    TEST_ASSERT_EQUAL(MIN_K - 1, st.largest_free);
+    TEST_ASSERT_EQUAL(5100, st.requested);
+    TEST_ASSERT_EQUAL(128 + 8192, st.reserved);
+
+    //Shrinking in place changes what was requested but not what is reserved
+    a = buddy_realloc(&pool, a, 30);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(5030, st.requested);
+    TEST_ASSERT_EQUAL(128 + 8192, st.reserved);
+
+    assert(buddy_malloc(&pool, UINT64_C(1) << MIN_K) == NULL);
+    buddy_free(&pool, b);
+    buddy_free(&pool, a);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(1, st.failures);
+    TEST_ASSERT_EQUAL(st.cost.splits, st.cost.merges);
+    TEST_ASSERT_EQUAL(0, st.requested);
+    TEST_ASSERT_EQUAL(0, st.reserved);
+    TEST_ASSERT_EQUAL(128 + 8192, st.high_water);
+    TEST_ASSERT_EQUAL(1, st.free_blocks[MIN_K]);
+
+    //Parked blocks are neither free nor used, slab objects count as their class
+    buddy_set_lazy(&pool, 4);
+    buddy_free(&pool, buddy_malloc(&pool, 100));
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(1, st.parked_blocks[7]);
+    TEST_ASSERT_EQUAL(0, st.used_blocks[7]);
+    buddy_set_lazy(&pool, 0);
+    buddy_slab_enable(&pool);
+    size_t usable = 0;
+    char *obj = buddy_malloc_usable(&pool, 20, &usable);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(usable, st.requested);
+    TEST_ASSERT_EQUAL(1, st.used_blocks[BUDDY_SLAB_K]);
+    buddy_free(&pool, obj);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(0, st.requested);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_cost_bounds(void)
+{
+    fprintf(stderr, "->Testing deterministic cost bounds\n");
+    struct buddy_pool pool;
+    struct buddy_stats st;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    size_t depth = MIN_K - SMALLEST_K;
+
+    //Eager ping-pong splits all the way down and merges all the way up
+    for (int i = 0; i < 100; i++) {
+        void *p = buddy_malloc(&pool, 40);
+        buddy_stats(&pool, &st);
+        assert(st.last.splits <= depth);
+        assert(st.last.links <= depth + 1);
+        buddy_free(&pool, p);
+        buddy_stats(&pool, &st);
+        assert(st.last.merges <= depth);
+        assert(st.last.links <= depth + 1);
+    }
+
+    //Lazy ping-pong touches a single list once per call
+    buddy_set_lazy(&pool, 8);
+    buddy_free(&pool, buddy_malloc(&pool, 40));
+    for (int i = 0; i < 100; i++) {
+        void *p = buddy_malloc(&pool, 40);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(0, st.last.splits);
+        TEST_ASSERT_EQUAL(1, st.last.links);
+        buddy_free(&pool, p);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(0, st.last.merges);
+        TEST_ASSERT_EQUAL(1, st.last.links);
+    }
+    buddy_set_lazy(&pool, 0);
+
+    //Realloc copies no more than the old payload, and nothing in place
+    char *mem = buddy_malloc(&pool, 1000);
+    mem = buddy_realloc(&pool, mem, 3000);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(1024 - sizeof(struct avail), st.last.copied);
+    mem = buddy_realloc(&pool, mem, 1000);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(0, st.last.copied);
+    buddy_free(&pool, mem);
+
+    //Slab objects from a partial slab never split or merge
+    buddy_slab_enable(&pool);
+    void *keep = buddy_malloc(&pool, 24);
+    for (int i = 0; i < 100; i++) {
+        void *p = buddy_malloc(&pool, 24);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(0, st.last.splits);
+        assert(st.last.links <= 2);
+        buddy_free(&pool, p);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(0, st.last.merges);
+        assert(st.last.links <= 2);
+    }
+    buddy_free(&pool, keep);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(st.cost.splits, st.cost.merges);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_histograms(void)
+{
+    fprintf(stderr, "->Testing latency histograms\n");
+    //Exact below 16 ticks, then 8 buckets per power of two
+    TEST_ASSERT_EQUAL(15, buddy_hist_floor(15));
+    TEST_ASSERT_EQUAL(16, buddy_hist_floor(16));
+    TEST_ASSERT_EQUAL(18, buddy_hist_floor(17));
+    TEST_ASSERT_EQUAL(32, buddy_hist_floor(24));
+    TEST_ASSERT_EQUAL(UINT64_C(15) << 60, buddy_hist_floor(BUDDY_HIST_BUCKETS - 1));
+    for (size_t b = 1; b < BUDDY_HIST_BUCKETS; b++) {
+        assert(buddy_hist_floor(b) > buddy_hist_floor(b - 1));
+    }
+
+    struct buddy_pool pool;
+    struct buddy_stats st;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    void *mem[10];
+    for (int i = 0; i < 10; i++) {
+        mem[i] = buddy_malloc(&pool, 100);
+    }
+    for (int i = 0; i < 10; i++) {
+        buddy_free(&pool, mem[i]);
+    }
+    buddy_stats(&pool, &st);
+#ifdef BUDDY_HISTOGRAMS
+    uint64_t mallocs = 0;
+    uint64_t frees = 0;
+    for (size_t b = 0; b < BUDDY_HIST_BUCKETS; b++) {
+        mallocs += st.hist->count[BUDDY_OP_MALLOC][7][b];
+        frees += st.hist->count[BUDDY_OP_FREE][7][b];
+    }
+    TEST_ASSERT_EQUAL(10, mallocs);
+    TEST_ASSERT_EQUAL(10, frees);
+#else
+    assert(st.hist == NULL);
+#endif
+    buddy_destroy(&pool);
+}
+
+void test_buddy_trace(void)
+{
+    fprintf(stderr, "->Testing allocation traces\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    char path[] = "/tmp/buddy-trace-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    assert(buddy_trace_start(&pool, path, 0) == -1);
+    assert(buddy_trace_start(&pool, path, 4) == 0);
+
+    char *a = buddy_malloc(&pool, 100);
+    char *b = buddy_malloc(&pool, 5000);
+    char *c = buddy_realloc(&pool, a, 3000);
+    buddy_free(&pool, b);
+    buddy_free(&pool, c);
+    char *d = buddy_malloc(&pool, 200);
+    buddy_trace_stop(&pool);
+    buddy_free(&pool, d);
+
+    struct buddy_trace_header hdr;
+    struct buddy_trace_record rec[4];
+    FILE *f = fopen(path, "rb");
+    assert(f != NULL);
+    assert(fread(&hdr, sizeof(hdr), 1, f) == 1);
+    assert(fread(rec, sizeof(rec[0]), 4, f) == 4);
+    fclose(f);
+    unlink(path);
+    assert(memcmp(hdr.magic, BUDDY_TRACE_MAGIC, 8) == 0);
+    TEST_ASSERT_EQUAL(BUDDY_TRACE_VERSION, hdr.version);
+    TEST_ASSERT_EQUAL(40, hdr.record_size);
+    TEST_ASSERT_EQUAL(4, hdr.capacity);
+    TEST_ASSERT_EQUAL((uintptr_t)pool.base, hdr.base);
+
+    //Six records in four slots, the first two were overwritten by one wrap
+    TEST_ASSERT_EQUAL(6, hdr.head);
+    TEST_ASSERT_EQUAL(1, hdr.wraps);
+    TEST_ASSERT_EQUAL(BUDDY_OP_REALLOC, rec[2].op);
+    TEST_ASSERT_EQUAL((uint64_t)(a - (char *)pool.base), rec[2].old_offset);
+    TEST_ASSERT_EQUAL((uint64_t)(c - (char *)pool.base), rec[2].offset);
+    TEST_ASSERT_EQUAL(3000, rec[2].size);
+    TEST_ASSERT_EQUAL(BUDDY_OP_FREE, rec[3].op);
+    TEST_ASSERT_EQUAL((uint64_t)(b - (char *)pool.base), rec[3].offset);
+    TEST_ASSERT_EQUAL(BUDDY_TRACE_NULL, rec[3].old_offset);
+    TEST_ASSERT_EQUAL(BUDDY_OP_FREE, rec[0].op);
+    TEST_ASSERT_EQUAL((uint64_t)(c - (char *)pool.base), rec[0].offset);
+    TEST_ASSERT_EQUAL(BUDDY_OP_MALLOC, rec[1].op);
+    TEST_ASSERT_EQUAL((uint64_t)(d - (char *)pool.base), rec[1].offset);
+    TEST_ASSERT_EQUAL(rec[0].tid, rec[1].tid);
+    assert(rec[1].tsc >= rec[0].tsc);
+    buddy_destroy(&pool);
+}
+
+void test_buddy_profile(void)
+{
+    fprintf(stderr, "->Testing sampling heap profiles\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    char path[] = "/tmp/buddy-heap-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    assert(buddy_profile_dump(&pool, path) == -1);
+
+    //A one byte rate samples every request larger than the longest gap
+    assert(buddy_profile_start(&pool, 1, path) == 0);
+    char *a = buddy_malloc(&pool, 100);
+    char *b = buddy_malloc(&pool, 200);
+    char *c = buddy_malloc(&pool, 300);
+    buddy_free(&pool, b);
+    a = buddy_realloc(&pool, a, 5000);
+    assert(buddy_profile_dump(&pool, NULL) == 0);
+
+    char line[4096];
+    size_t samples = 0;
+    size_t objs = 0;
+    size_t bytes = 0;
+    size_t rate = 0;
+    bool maps = false;
+    FILE *f = fopen(path, "r");
+    assert(f != NULL);
+    assert(fgets(line, sizeof(line), f) != NULL);
+    assert(sscanf(line, "heap profile: %zu: %zu [%*u: %*u] @ heap_v2/%zu", &objs, &bytes, &rate) == 3);
+    while (fgets(line, sizeof(line), f)) {
+        samples += strstr(line, "] @ 0x") != NULL;
+        maps |= strcmp(line, "MAPPED_LIBRARIES:\n") == 0;
+    }
+    fclose(f);
+    TEST_ASSERT_EQUAL(2, objs);
+    TEST_ASSERT_EQUAL(5300, bytes);
+    TEST_ASSERT_EQUAL(1, rate);
+    TEST_ASSERT_EQUAL(2, samples);
+    assert(maps);
+
+    //Destroy dumps again to the start path
+    assert(truncate(path, 0) == 0);
+    buddy_free(&pool, c);
+    buddy_destroy(&pool);
+    f = fopen(path, "r");
+    assert(f != NULL);
+    assert(fgets(line, sizeof(line), f) != NULL);
+    fclose(f);
+    unlink(path);
+    assert(sscanf(line, "heap profile: %zu: %zu", &objs, &bytes) == 2);
+    TEST_ASSERT_EQUAL(1, objs);
+    TEST_ASSERT_EQUAL(5000, bytes);
+}
 
 int main(void) {
   time_t t;
@@ -517,5 +1512,26 @@ int main(void) {
   RUN_TEST(test_buddy_init);
   RUN_TEST(test_buddy_malloc_one_byte);
   RUN_TEST(test_buddy_malloc_one_large);
+  RUN_TEST(test_buddy_mapping_cache);
+  RUN_TEST(test_buddy_arena);
+  RUN_TEST(test_buddy_child_pools);
+  RUN_TEST(test_buddy_slab);
+  RUN_TEST(test_buddy_slab_profile);
+  RUN_TEST(test_buddy_slab_profile_tiny);
+  RUN_TEST(test_buddy_lazy_coalescing);
+  RUN_TEST(test_buddy_rt_mode);
+  RUN_TEST(test_buddy_address_policy);
+  RUN_TEST(test_buddy_segregated_policy);
+  RUN_TEST(test_buddy_lifetime_hints);
+  RUN_TEST(test_buddy_malloc_near);
+  RUN_TEST(test_buddy_colors);
+  RUN_TEST(test_buddy_malloc_range);
+  RUN_TEST(test_buddy_usable_size);
+  RUN_TEST(test_buddy_free_sized);
+  RUN_TEST(test_buddy_stats);
+  RUN_TEST(test_buddy_cost_bounds);
+  RUN_TEST(test_buddy_histograms);
+  RUN_TEST(test_buddy_trace);
+  RUN_TEST(test_buddy_profile);
   return UNITY_END();
 }